@@ -0,0 +1,53 @@
+//
+// Compare the libjpeg-turbo fast path with the ImageMagick pipeline for JPEG thumbnails
+//
+// Usage: node bench/jpeg.js photo.jpg [width] [count] [concurrency]
+//
+
+var fs = require("fs");
+var wand = require("../build/Release/binding");
+
+var file = process.argv[2];
+var width = parseInt(process.argv[3] || 320);
+var count = parseInt(process.argv[4] || 50);
+var concurrency = parseInt(process.argv[5] || 4);
+
+if (!file) {
+    console.log("usage: node bench/jpeg.js photo.jpg [width] [count] [concurrency]");
+    process.exit(1);
+}
+var data = fs.readFileSync(file);
+
+function run(engine, callback)
+{
+    var started = Date.now(), done = 0, running = 0, queued = 0, bytes = 0, times = [];
+
+    function next() {
+        while (running < concurrency && queued < count) {
+            queued++;
+            running++;
+            var t = process.hrtime();
+            wand.resizeImage(data, { width: width, quality: 80, engine: engine }, function(err, img, info) {
+                if (err) console.log(engine, err);
+                var d = process.hrtime(t);
+                times.push(d[0] * 1000 + d[1] / 1e6);
+                bytes += img ? img.length : 0;
+                running--;
+                if (++done == count) {
+                    times.sort(function(a, b) { return a - b });
+                    var elapsed = Date.now() - started;
+                    console.log(engine, "images:", count, "time:", elapsed, "ms", "rate:", (count * 1000 / elapsed).toFixed(1), "/sec",
+                                "p50:", times[Math.floor(count * 0.5)].toFixed(2), "p99:", times[Math.floor(count * 0.99)].toFixed(2),
+                                "size:", Math.round(bytes / count), "rss:", Math.round(process.memoryUsage().rss / 1048576), "MB");
+                    return callback();
+                }
+                next();
+            });
+        }
+    }
+    next();
+}
+
+run("magick", function() {
+    run("auto", function() {});
+});
@@ -0,0 +1,190 @@
+//
+// Native microbenchmark of the resize core without V8, to profile decode, resize and encode in isolation
+//
+// Usage: build/Release/bench photo.jpg [count] [name=value ...]
+//   build/Release/bench_q8 is the same linked with the 8-bit ImageMagick
+//   options are the same as for resizeImage, threads=N sets ImageMagick threads per job
+//   example: build/Release/bench photo.jpg 100 width=320 quality=80 filter=catrom
+//
+
+#define WAND_NO_NODE
+
+#ifdef WAND_NO_UV
+// libuv is usually not installed as a library, only the primitives used by the image core are provided over
+// pthreads and clock_gettime, the event loop parts are never run by the benchmark
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define UV_E2BIG (-E2BIG)
+#define UV_EBUSY (-EBUSY)
+#define UV_ECANCELED (-ECANCELED)
+#define UV_ETIMEDOUT (-ETIMEDOUT)
+
+typedef pthread_mutex_t uv_mutex_t;
+typedef pthread_cond_t uv_cond_t;
+typedef pthread_t uv_thread_t;
+typedef struct { void *data; } uv_loop_t;
+typedef struct { void *data; } uv_handle_t;
+typedef struct { void *data; } uv_async_t;
+
+static uint64_t uv_hrtime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t uv_now(uv_loop_t *loop)
+{
+    return uv_hrtime() / 1000000;
+}
+
+static const char *uv_strerror(int err)
+{
+    return strerror(-err);
+}
+
+static int uv_mutex_init(uv_mutex_t *m) { return -pthread_mutex_init(m, NULL); }
+static void uv_mutex_destroy(uv_mutex_t *m) { pthread_mutex_destroy(m); }
+static void uv_mutex_lock(uv_mutex_t *m) { pthread_mutex_lock(m); }
+static void uv_mutex_unlock(uv_mutex_t *m) { pthread_mutex_unlock(m); }
+static int uv_cond_init(uv_cond_t *c) { return -pthread_cond_init(c, NULL); }
+static void uv_cond_destroy(uv_cond_t *c) { pthread_cond_destroy(c); }
+static void uv_cond_signal(uv_cond_t *c) { pthread_cond_signal(c); }
+static void uv_cond_broadcast(uv_cond_t *c) { pthread_cond_broadcast(c); }
+static void uv_cond_wait(uv_cond_t *c, uv_mutex_t *m) { pthread_cond_wait(c, m); }
+static uv_thread_t uv_thread_self() { return pthread_self(); }
+
+struct bkThreadStart {
+    void (*cb)(void*);
+    void *arg;
+};
+
+static void *bkThreadMain(void *arg)
+{
+    bkThreadStart start = *(bkThreadStart*)arg;
+    free(arg);
+    start.cb(start.arg);
+    return NULL;
+}
+
+static int uv_thread_create(uv_thread_t *tid, void (*cb)(void*), void *arg)
+{
+    bkThreadStart *start = (bkThreadStart*)malloc(sizeof(bkThreadStart));
+    if (!start) return -ENOMEM;
+    start->cb = cb;
+    start->arg = arg;
+    int rc = pthread_create(tid, NULL, bkThreadMain, start);
+    if (rc) free(start);
+    return -rc;
+}
+
+static int uv_async_init(uv_loop_t *loop, uv_async_t *async, void (*cb)(uv_async_t*)) { return 0; }
+static int uv_async_send(uv_async_t *async) { return 0; }
+static void uv_close(uv_handle_t *handle, void (*cb)(uv_handle_t*)) { if (cb) cb(handle); }
+static void uv_ref(uv_handle_t *handle) {}
+static void uv_unref(uv_handle_t *handle) {}
+#endif
+
+#include "../binding.cpp"
+#include <sys/resource.h>
+
+static int bkCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file [count] [name=value ...]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp) {
+        fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    vector<unsigned char> data;
+    unsigned char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.insert(data.end(), buf, buf + n);
+    fclose(fp);
+
+    int count = argc > 2 ? atoi(argv[2]) : 100;
+    if (count <= 0) count = 1;
+
+    MagickWandGenesis();
+    printf("%s\n", MagickGetVersion(NULL));
+
+    MagickBaton opts;
+    for (int i = 3; i < argc; i++) {
+        string arg = argv[i];
+        string::size_type eq = arg.find('=');
+        string key = arg.substr(0, eq), val = eq != string::npos ? arg.substr(eq + 1) : "1";
+        if (key == "threads") {
+            MagickSetResourceLimit(ThreadResource, atoi(val.c_str()));
+            continue;
+        }
+        string err = setMagickOption(&opts, key.c_str(), val.c_str());
+        if (err.size()) {
+            fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+    }
+
+    vector<uint64_t> t[MagickStageMax];
+    size_t bytes = 0;
+    uint64_t started = uv_hrtime();
+    for (int i = 0; i < count; i++) {
+        MagickBaton *baton = new MagickBaton;
+        copyMagickOptions(baton, &opts);
+        baton->blob = &data[0];
+        baton->blob_length = data.size();
+        baton->start = uv_hrtime();
+
+        WandWork req;
+        req.data = baton;
+        doResizeImage(&req);
+        baton->t[MagickStageTotal] = uv_hrtime() - baton->start;
+
+        if (baton->err || baton->exception) {
+            fprintf(stderr, "%s\n", baton->err ? strerror(baton->err) : baton->exception);
+            return 1;
+        }
+        for (int s = 0; s < MagickStageMax; s++) t[s].push_back(baton->t[s]);
+        bytes += baton->length;
+        if (!i) printf("%s %dx%d -> %s %dx%d\n", baton->o.ext.c_str(), baton->o.width, baton->o.height, baton->ext.c_str(), baton->d.width, baton->d.height);
+        freeMagickImage(baton);
+        delete baton;
+    }
+    double elapsed = (uv_hrtime() - started) / 1e9;
+
+    printf("%-10s %10s %10s %10s %10s\n", "stage", "avg", "p50", "p99", "max");
+    for (int s = 0; s < MagickStageMax; s++) {
+        if (s == MagickStageQueue) continue;
+        uint64_t sum = 0;
+        for (uint i = 0; i < t[s].size(); i++) sum += t[s][i];
+        qsort(&t[s][0], t[s].size(), sizeof(uint64_t), bkCompare);
+        printf("%-10s %10.3f %10.3f %10.3f %10.3f\n", magickStages[s], sum / 1e6 / count,
+               t[s][count / 2] / 1e6, t[s][count * 99 / 100] / 1e6, t[s][count - 1] / 1e6);
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef OS_MACOSX
+    long rss = ru.ru_maxrss / 1024;
+#else
+    long rss = ru.ru_maxrss;
+#endif
+    printf("images: %d rate: %.1f/sec size: %lu peak rss: %ld KB\n", count, count / elapsed, (unsigned long)(bytes / count), rss);
+
+    MagickWandTerminus();
+    return 0;
+}
@@ -0,0 +1,157 @@
+//
+// Resize pipeline benchmark on a generated corpus, reports throughput, p50/p99 latency and peak RSS
+//
+// Usage: node bench/run.js [-count 20] [-concurrency 1,2,4] [-sizes 1,4,12] [-formats jpg,png,gif,webp] [-ops thumbnail,crop] [-precision 16,8] [-json]
+//
+// The corpus is generated once into bench/corpus from deterministic pixels so results are comparable
+// between ImageMagick versions and builds, -precision runs every test with the 16-bit and the 8-bit engine if built,
+// peak RSS only grows so run each precision separately to compare memory
+//
+
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var wand = require("..");
+
+var args = {};
+for (var i = 2; i < process.argv.length; i++) {
+    if (process.argv[i][0] != "-") continue;
+    var v = process.argv[i + 1];
+    args[process.argv[i].substr(1)] = !v || v[0] == "-" ? 1 : process.argv[++i];
+}
+
+function list(name, dflt)
+{
+    return String(args[name] || dflt).split(",").filter(function(x) { return x });
+}
+
+var count = Math.max(1, parseInt(args.count || 20) || 1);
+var cores = os.cpus().length, levels = [];
+for (var c = 1; c < cores; c *= 2) levels.push(c);
+levels.push(cores);
+var concurrency = list("concurrency", levels.join(",")).map(Number);
+var sizes = list("sizes", "1,4,12").map(Number);
+var formats = list("formats", "jpg,png,gif,webp");
+var precisions = list("precision", "16").map(Number).filter(function(x) { return wand.getEngine(x).getVersion().quantum == x });
+var dir = args.dir || path.join(__dirname, "corpus");
+
+var ops = {
+    thumbnail: { width: 320, height: 320, quality: 80 },
+    resize: { width: 1280, quality: 85 },
+    crop: { crop_x: 100, crop_y: 100, crop_width: 800, crop_height: 600, width: 400 },
+    rotate: { rotate: 90, width: 1024 },
+    quantize: { width: 640, quantize: 64 },
+    catrom: { width: 1024, filter: "catrom" },
+    mitchell: { width: 1024, filter: "mitchell" },
+    box: { width: 1024, filter: "box" },
+    fast: { width: 1280, quality: 80, profile: "fast" },
+    small: { width: 1280, quality: 80, profile: "small" },
+    webp: { width: 1280, quality: 80, ext: "webp" },
+};
+var names = list("ops", Object.keys(ops).join(","));
+
+// Gradients, 64 pixel blocks and noise from a fixed seed
+function pixels(width, height)
+{
+    var data = Buffer.alloc(width * height * 3), x = 12345;
+    for (var y = 0, o = 0; y < height; y++) {
+        for (var i = 0; i < width; i++, o += 3) {
+            x = (Math.imul(x, 1664525) + 1013904223) >>> 0;
+            var n = x >>> 27;
+            data[o] = (i * 255 / width + n) & 255;
+            data[o + 1] = (y * 255 / height + n) & 255;
+            data[o + 2] = ((i >> 6) + (y >> 6)) & 1 ? 200 - n : 40 + n;
+        }
+    }
+    return data;
+}
+
+function corpus(callback)
+{
+    var files = [], jobs = [];
+    if (!fs.existsSync(dir)) fs.mkdirSync(dir);
+    sizes.forEach(function(mp) {
+        var width = Math.round(Math.sqrt(mp * 1e6 * 4 / 3)), height = Math.round(width * 3 / 4);
+        formats.forEach(function(ext) {
+            var file = path.join(dir, "img-" + mp + "mp." + ext);
+            files.push(file);
+            if (!fs.existsSync(file)) jobs.push({ file: file, ext: ext, width: width, height: height });
+        });
+    });
+    (function next() {
+        var job = jobs.shift();
+        if (!job) return callback(files);
+        console.error("generating", job.file);
+        var src = { data: pixels(job.width, job.height), width: job.width, height: job.height, layout: "rgb" };
+        wand.resizeImage(src, { ext: job.ext, quality: 90, outfile: job.file }, function(err) {
+            if (err) console.error(job.file, err);
+            next();
+        });
+    })();
+}
+
+function run(file, name, level, precision, callback)
+{
+    var started = Date.now(), done = 0, running = 0, queued = 0, errors = 0, bytes = 0, times = [], rss = 0;
+    var data = fs.readFileSync(file);
+    var timer = setInterval(function() { rss = Math.max(rss, process.memoryUsage().rss) }, 10);
+
+    wand.setPoolOptions({ workers: level });
+    (function next() {
+        while (running < level && queued < count) {
+            queued++;
+            running++;
+            var t = process.hrtime();
+            wand.resizeImage(data, Object.assign({ cache: 0, precision: precision }, ops[name]), function(err, img, info) {
+                var d = process.hrtime(t);
+                times.push(d[0] * 1000 + d[1] / 1e6);
+                if (err) errors++;
+                bytes += img ? img.length : 0;
+                rss = Math.max(rss, process.memoryUsage().rss);
+                running--;
+                if (++done < count) return next();
+                clearInterval(timer);
+                times.sort(function(a, b) { return a - b });
+                var elapsed = Date.now() - started;
+                callback({
+                    file: path.basename(file),
+                    op: name,
+                    concurrency: level,
+                    precision: precision,
+                    images: count,
+                    errors: errors,
+                    rate: +(count * 1000 / elapsed).toFixed(1),
+                    p50: +times[Math.floor(count * 0.5)].toFixed(2),
+                    p99: +times[Math.min(count - 1, Math.floor(count * 0.99))].toFixed(2),
+                    size: Math.round(bytes / count),
+                    rss: Math.round(rss / 1048576),
+                });
+            });
+        }
+    })();
+}
+
+corpus(function(files) {
+    var tests = [];
+    files.forEach(function(file) {
+        names.forEach(function(name) {
+            if (!ops[name]) return;
+            concurrency.forEach(function(level) {
+                precisions.forEach(function(precision) { tests.push([file, name, level, precision]) });
+            });
+        });
+    });
+    if (!args.json) console.log(["file", "op", "concurrency", "precision", "rate/sec", "p50 ms", "p99 ms", "size", "rss MB", "errors"].join("\t"));
+    (function next() {
+        var test = tests.shift();
+        if (!test) return;
+        run(test[0], test[1], test[2], test[3], function(r) {
+            if (args.json) {
+                console.log(JSON.stringify(r));
+            } else {
+                console.log([r.file, r.op, r.concurrency, r.precision, r.rate, r.p50, r.p99, r.size, r.rss, r.errors].join("\t"));
+            }
+            next();
+        });
+    })();
+});
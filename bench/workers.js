@@ -0,0 +1,85 @@
+//
+// Stress test of the module loaded in several worker threads at once, each worker runs parallel resizes and
+// checks the results, some workers are terminated while their jobs are still running
+//
+// Usage: node bench/workers.js [-workers 4] [-count 50] [-concurrency 4] [-size 1024] [-terminate 1]
+//
+
+var path = require("path");
+var threads = require("worker_threads");
+
+var args = {};
+for (var i = 2; i < process.argv.length; i++) {
+    if (process.argv[i][0] != "-") continue;
+    var v = process.argv[i + 1];
+    args[process.argv[i].substr(1)] = !v || v[0] == "-" ? 1 : process.argv[++i];
+}
+
+var workers = parseInt(args.workers || 4);
+var count = parseInt(args.count || 50);
+var concurrency = parseInt(args.concurrency || 4);
+var size = parseInt(args.size || 1024);
+var terminate = parseInt(args.terminate || 1);
+
+// Every thread resizes the same generated image to its own widths so results from other workers would not match
+function work(id, callback)
+{
+    var wand = require(path.join(__dirname, ".."));
+    var data = Buffer.alloc(size * size * 3);
+    for (var i = 0; i < data.length; i++) data[i] = (i * 7 + id * 31) & 255;
+    var src = { data: data, width: size, height: size, layout: "rgb" };
+    var done = 0, queued = 0, running = 0, errors = 0, started = Date.now();
+
+    (function next() {
+        while (running < concurrency && queued < count) {
+            var width = 64 + ((id * count + queued++) % 256);
+            running++;
+            wand.resize(src, { width: width, ext: "jpg", cache: 0 }).then(function(width, res) {
+                if (res.info.width != width) throw new Error("thread " + id + ": expected width " + width + " got " + res.info.width);
+            }.bind(null, width)).catch(function(err) {
+                errors++;
+                console.error("thread", id, err.message);
+            }).then(function() {
+                running--;
+                if (++done < count) return next();
+                callback({ thread: id, images: count, errors: errors, elapsed: Date.now() - started });
+            });
+        }
+    })();
+}
+
+if (!threads.isMainThread) {
+    work(threads.workerData.id, function(r) { threads.parentPort.postMessage(r) });
+    return;
+}
+
+var started = Date.now(), total = 0, errors = 0, pending = workers + 1;
+
+function finish(r)
+{
+    if (r) {
+        total += r.images;
+        errors += r.errors;
+        console.log(JSON.stringify(r));
+    }
+    if (--pending) return;
+    var wand = require(path.join(__dirname, ".."));
+    console.log("images:", total, "errors:", errors, "elapsed:", Date.now() - started, "ms", "pool:", JSON.stringify(wand.getPoolStats()));
+    process.exitCode = errors ? 1 : 0;
+}
+
+for (var i = 1; i <= workers; i++) {
+    var w = new threads.Worker(__filename, { workerData: { id: i } });
+    w.on("message", finish);
+    w.on("error", function(err) {
+        errors++;
+        console.error(err);
+    });
+    // Cleanup with jobs in flight must not crash or leak callbacks into other threads
+    if (terminate && i == workers && workers > 1) {
+        pending--;
+        w.removeAllListeners("message");
+        setTimeout(w.terminate.bind(w), 50);
+    }
+}
+work(0, finish);
@@ -3,18 +3,45 @@
 //  April 2013
 //
 
+// WAND_NO_NODE builds only the image core for native tools like the benchmark
+#ifndef WAND_NO_NODE
 #include <node.h>
 #include <node_object_wrap.h>
 #include <node_buffer.h>
 #include <node_version.h>
 #include <v8.h>
 #include <v8-profiler.h>
-#include <uv.h>
 #include <nan.h>
+#endif
+// Native tools built without libuv provide the few uv primitives themselves, see bench/resize.cpp
+#ifndef WAND_NO_UV
+#include <uv.h>
+#endif
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
 
+#ifndef WAND_NO_NODE
 using namespace node;
 using namespace v8;
+#endif
 using namespace std;
 
 #ifdef USE_WAND
@@ -22,23 +49,79 @@ using namespace std;
 #define NAN_REQUIRE_ARGUMENT(i) if (info.Length() <= i || info[i]->IsUndefined()) {Nan::ThrowError("Argument " #i " is required");return;}
 #define NAN_REQUIRE_ARGUMENT_OBJECT(i, var) if (info.Length() <= (i) || !info[i]->IsObject()) {Nan::ThrowError("Argument " #i " must be an object"); return;} Local<Object> var(Nan::To<v8::Object>(info[i]).ToLocalChecked());
 
-#define NAN_TRY_CATCH_CALL(context, callback, argc, argv) { Nan::TryCatch try_catch; Nan::Call((callback), (context), (argc), (argv)); if (try_catch.HasCaught()) FatalException(try_catch); }
+// Callbacks of jobs cancelled by the environment teardown are not called
+#define NAN_TRY_CATCH_CALL(context, callback, argc, argv) { if (!env->closing) { Nan::TryCatch try_catch; Nan::Call((callback), (context), (argc), (argv)); if (try_catch.HasCaught()) FatalException(try_catch); } }
 
 #include "MagickWand/MagickWand.h"
 
+#ifdef USE_JPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#endif
+
+// Job stages measured for timings and stats
+enum {
+    MagickStageQueue,
+    MagickStageDecode,
+    MagickStageTransform,
+    MagickStageResize,
+    MagickStageEncode,
+    MagickStageTotal,
+    MagickStageMax
+};
+
+static const char *magickStages[] = { "queue", "decode", "transform", "resize", "encode", "total" };
+
+// Encoded image shared by the cache and all results returned for it, released by the last owner
+struct MagickImageRef {
+    MagickImageRef(unsigned char *d, bool m): refs(1), data(d), malloc(m) {}
+    std::atomic<int> refs;
+    unsigned char *data;
+    bool malloc;
+};
+
 // Async request for magickwand resize callback
 class MagickBaton {
 public:
-    MagickBaton(): image(0), exception(0), err(0) {
+    MagickBaton(): image(0), exception(0), err(0), length(0), timeout(0), output_data(0), output_length(0), image_malloc(0), image_ref(0), blob(0), blob_length(0), fd(-1), out_fd(-1), fd_offset(-1), scale(1), cache_hit(0), cache_lookup(0), cache_running(0), cache_wait(0), complete(0), severity(UndefinedException), memory(0), start(0) {
         memset(&d, 0, sizeof(d));
+        memset(t, 0, sizeof(t));
+        o.width = o.height = o.orientation = o.frames = o.alpha = 0;
+        o.size = 0;
+        o.pixels = 0;
+        in.width = in.height = 0;
+        in.storage = CharPixel;
         filter = LanczosFilter;
         d.gravity = UndefinedGravity;
         d.colorspace = UndefinedColorspace;
+        d.shrink = 1;
+        d.cascade = 1;
+        d.reorder = 1;
+        d.cache = 1;
+        d.storage = CharPixel;
+        d.progressive = d.optimize = d.png_level = d.png_strategy = d.png_filter = -1;
+        d.webp_method = d.lossless = d.alpha_quality = d.speed = -1;
     }
     ~MagickBaton() {
+#ifndef WAND_NO_NODE
         cb.Reset();
+        buffer.Reset();
+        output.Reset();
+#endif
+        for (uint i = 0; i < list.size(); i++) delete list[i];
+        if (fd >= 0) close(fd);
+        if (out_fd >= 0) close(out_fd);
     }
+#ifndef WAND_NO_NODE
     Nan::Persistent<Function> cb;
+    // Source Buffer is kept alive while the image is read in place
+    Nan::Persistent<Object> buffer;
+    // Caller Buffer for raw pixels output
+    Nan::Persistent<Object> output;
+#endif
     unsigned char *image;
     char *exception;
     string format;
@@ -49,11 +132,64 @@ public:
     int err;
     size_t length;
     string bgcolor;
+    string engine;
+    // Milliseconds from the call until the job is expired
+    int timeout;
+    unsigned char *output_data;
+    size_t output_length;
+    // Image is allocated by malloc, not by ImageMagick
+    bool image_malloc;
+    // Image is shared with the cache, must not be modified
+    MagickImageRef *image_ref;
+    const unsigned char *blob;
+    size_t blob_length;
+    // Source and output descriptors owned by the job, closed once read or written
+    int fd;
+    int out_fd;
+    // Start of a regular file source descriptor, it is read again from there, -1 for pipes which are read only once
+    off_t fd_offset;
+    // Decoded size relative to the original image
+    double scale;
+    // Source identity and all parsed options, compared in full on every cache hit
+    string cache_key;
+    string cache_file;
+    bool cache_hit;
+    // The job computes the key and checks the cache before running
+    bool cache_lookup;
+    // The same request was running when the job checked the cache, set by the pool thread
+    bool cache_running;
+    // Waits for the same request run by another job
+    bool cache_wait;
+    // The result is ready, a deadline passed after that does not fail the job
+    bool complete;
+    ExceptionType severity;
+    // Pixel cache in use while the job was running
+    MagickSizeType memory;
+    // Enqueue time and stage durations in nanoseconds
+    uint64_t start;
+    uint64_t t[MagickStageMax];
+    // Raw pixels source
+    struct {
+        int width;
+        int height;
+        string layout;
+        StorageType storage;
+        // Format of a descriptor source, detected from a temporary copy if not given
+        string ext;
+    } in;
+    // Renditions produced from the same source image
+    vector<MagickBaton*> list;
     struct {
         int width;
         int height;
         int orientation;
+        int frames;
+        int alpha;
+        size_t size;
+        // Pixels in all frames from the header
+        double pixels;
         string ext;
+        string colorspace;
     } o;
     struct {
         int quality;
@@ -84,7 +220,43 @@ public:
         double opacity;
         int orientation;
         int no_animation;
+        int shrink;
+        int cascade;
+        int strict;
+        int reorder;
+        int cache;
+        int max_frames;
+        int frame_threads;
+        double max_frame_pixels;
+        // Raw pixels output layout like RGBA
+        char raw[8];
+        StorageType storage;
+        // Encoder settings, -1 or empty keeps the encoder default unless the profile sets it
+        int profile;
+        int progressive;
+        int optimize;
+        int sampling_h;
+        int sampling_v;
+        char dct[8];
+        int png_level;
+        int png_strategy;
+        int png_filter;
+        int webp_method;
+        int lossless;
+        int alpha_quality;
+        int speed;
+        // Analysis of the result: dhash flag, number of dominant colors, BlurHash components
+        int dhash;
+        int colors;
+        int blurhash_x;
+        int blurhash_y;
     } d;
+    // Analysis results
+    struct {
+        string dhash;
+        vector<string> colors;
+        string blurhash;
+    } a;
 };
 
 static string getMagickOrientation(int type)
@@ -167,6 +339,72 @@ static GravityType getMagickGravity(string type)
            type == "southeast" ? SouthEastGravity : UndefinedGravity;
 }
 
+static StorageType getMagickStorage(string type)
+{
+    return type == "char" ? CharPixel :
+           type == "short" ? ShortPixel :
+           type == "long" ? LongPixel :
+           type == "longlong" ? LongLongPixel :
+           type == "float" ? FloatPixel :
+           type == "double" ? DoublePixel :
+           type == "quantum" ? QuantumPixel : UndefinedPixel;
+}
+
+static string getMagickStorageName(StorageType type)
+{
+    return type == CharPixel ? "char" :
+           type == ShortPixel ? "short" :
+           type == LongPixel ? "long" :
+           type == LongLongPixel ? "longlong" :
+           type == FloatPixel ? "float" :
+           type == DoublePixel ? "double" :
+           type == QuantumPixel ? "quantum" : "";
+}
+
+static size_t getMagickStorageSize(StorageType type)
+{
+    return type == CharPixel ? 1 :
+           type == ShortPixel ? 2 :
+           type == LongPixel || type == FloatPixel ? 4 :
+           type == LongLongPixel || type == DoublePixel ? 8 :
+           type == QuantumPixel ? sizeof(Quantum) : 0;
+}
+
+enum { MagickProfileNone, MagickProfileFast, MagickProfileSmall };
+
+static int getMagickProfile(string type)
+{
+    return type == "fast" ? MagickProfileFast :
+           type == "small" ? MagickProfileSmall : -1;
+}
+
+// Encoder setting if given, otherwise the value for the fast or small profile
+static int getMagickProfileValue(MagickBaton *baton, int value, int fast, int small)
+{
+    if (value >= 0) return value;
+    return baton->d.profile == MagickProfileFast ? fast : baton->d.profile == MagickProfileSmall ? small : -1;
+}
+
+// JPEG chroma subsampling as J:a:b into the luma sampling factors
+static bool getMagickSampling(const char *type, int &h, int &v)
+{
+    h = v = 0;
+    if (!strcmp(type, "4:4:4")) h = 1, v = 1; else
+    if (!strcmp(type, "4:2:2")) h = 2, v = 1; else
+    if (!strcmp(type, "4:2:0")) h = 2, v = 2; else
+    if (!strcmp(type, "4:1:1")) h = 4, v = 1;
+    return h > 0;
+}
+
+// Pixel layout for import and export in ImageMagick map format, gray is an alias for I, empty if not valid
+static string getMagickLayout(string layout)
+{
+    std::transform(layout.begin(), layout.end(), layout.begin(), ::toupper);
+    if (layout == "GRAY") layout = "I";
+    if (layout.empty() || layout.size() > 7 || layout.find_first_not_of("RGBAOCMYKIP") != string::npos) return "";
+    return layout;
+}
+
 static int getMagickAngle(int orientation)
 {
     switch (orientation) {
@@ -210,9 +448,24 @@ static vector<string> bkStrSplit(const string str, const string delim, const str
     return rc;
 }
 
+// Directories created or found by bkMakePath, used from all worker threads
+static struct {
+    pthread_mutex_t lock;
+    unordered_set<string> dirs;
+} paths = { PTHREAD_MUTEX_INITIALIZER, {} };
+
+// Create all parent directories of the file, a known directory is only checked for existence
 static bool bkMakePath(string path)
 {
-    string dir;
+    string::size_type slash = path.find_last_of('/');
+    if (slash == string::npos || !slash) return 1;
+    string parent = path.substr(0, slash);
+    pthread_mutex_lock(&paths.lock);
+    bool known = paths.dirs.count(parent);
+    pthread_mutex_unlock(&paths.lock);
+    if (known && !access(parent.c_str(), F_OK)) return 1;
+
+    string dir = path[0] == '/' ? "/" : "";
     vector<string> list = bkStrSplit(path, "/", "");
     for (uint i = 0; i < list.size() - 1; i++) {
         dir += list[i] + '/';
@@ -223,330 +476,3933 @@ static bool bkMakePath(string path)
             }
         }
     }
+    pthread_mutex_lock(&paths.lock);
+    if (paths.dirs.size() >= 10000) paths.dirs.clear();
+    paths.dirs.insert(parent);
+    pthread_mutex_unlock(&paths.lock);
     return 1;
 }
 
-static void doResizeImage(uv_work_t *req)
+// Stdio stream over the descriptor which is closed on error, the descriptor is owned by the stream after that
+static FILE *bkOpenFd(int &fd, const char *mode)
 {
-    MagickBaton *baton = (MagickBaton *)req->data;
-    MagickWand *wand = NewMagickWand();
-    MagickBooleanType status;
-    ExceptionType severity;
-    char *str;
+    FILE *fp = fdopen(fd, mode);
+    if (!fp) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    fd = -1;
+    return fp;
+}
 
-    if (baton->image) {
-        status = MagickReadImageBlob(wand, baton->image, baton->length);
-        free(baton->image);
-        baton->image = NULL;
-    } else {
-        status = MagickReadImage(wand, baton->path.c_str());
+// Nanoseconds since the given time which is moved to now
+static uint64_t bkLap(uint64_t &t)
+{
+    uint64_t now = uv_hrtime();
+    uint64_t d = now - t;
+    t = now;
+    return d;
+}
+
+// Job for the image worker pool
+struct WandWork;
+typedef void (*wand_work_cb)(WandWork *req);
+typedef void (*wand_after_work_cb)(WandWork *req, int status);
+typedef int64_t (*wand_cost_cb)(WandWork *req);
+
+struct WandEnv;
+
+struct WandWork {
+    WandWork(): data(0), env(0), work_cb(0), after_cb(0), cost_cb(0), status(0), cost(-1), reserved(0), id(0), cancelled(0), deadline(0) {}
+    void *data;
+    // Environment that queued the job, the completion runs on its event loop
+    WandEnv *env;
+    wand_work_cb work_cb;
+    wand_after_work_cb after_cb;
+    // Estimates memory needed by the job, called once on a worker thread before running the job
+    wand_cost_cb cost_cb;
+    int status;
+    int64_t cost;
+    int64_t reserved;
+    uint32_t id;
+    // Set from the event loop thread, checked by the running job
+    volatile bool cancelled;
+    // Time by uv_hrtime when the job expires, 0 for no deadline
+    uint64_t deadline;
+};
+
+// Encoded results by source and options of one environment, the pool jobs look up entries and running requests
+// under the lock, everything else is only used by the event loop thread
+struct MagickCache {
+    MagickCache(): max_size(0), size(0), disk_max_size(0), disk_max_age(0), disk_written(0), disk_trimmed(0), disk_trimming(0), hits(0), misses(0), coalesced(0), evictions(0), disk_hits(0) {
+        uv_mutex_init(&lock);
+    }
+    ~MagickCache() {
+        uv_mutex_destroy(&lock);
     }
-    int frames = MagickGetNumberImages(wand);
+    uv_mutex_t lock;
+    size_t max_size;
+    size_t size;
+    string dir;
+    // Disk tier limits in bytes and seconds since the last use, checked by a pool job after enough new files
+    size_t disk_max_size;
+    int disk_max_age;
+    size_t disk_written;
+    uint64_t disk_trimmed;
+    bool disk_trimming;
+    list<MagickBaton*> lru;
+    unordered_map<string, list<MagickBaton*>::iterator> items;
+    // Requests waiting for the same job to finish
+    unordered_map<string, vector<WandWork*> > pending;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced;
+    uint64_t evictions;
+    uint64_t disk_hits;
+};
 
-    if (status == MagickFalse) goto err;
+// State of one Node.js environment, the main thread or a worker thread, each has its own event loop
+struct WandEnv {
+    WandEnv(): loop(0), pending(0), next_id(0), closing(0), close_cb(0), close_arg(0) {}
+    uv_loop_t *loop;
+    uv_async_t async;
+    // Finished jobs, protected by the pool lock
+    deque<WandWork*> done;
+    int pending;
+    // Queued and running jobs by id
+    unordered_map<uint32_t, WandWork*> jobs;
+    uint32_t next_id;
+    MagickCache cache;
+    // Environment is being torn down, waiting for all jobs to finish
+    bool closing;
+    void (*close_cb)(void*);
+    void *close_arg;
+#ifndef WAND_NO_NODE
+    Nan::Persistent<FunctionTemplate> preset;
+    node::AsyncCleanupHookHandle cleanup;
+#endif
+};
 
-    // Original image properties
-    baton->o.width = MagickGetImageWidth(wand);
-    baton->o.height = MagickGetImageHeight(wand);
-    str = MagickGetImageProperty(wand, "exif:Orientation");
-    if (str) {
-        baton->d.orientation = baton->o.orientation = atoi(str);
-        free(str);
+// Environment of the calling thread, every environment runs on its own thread
+static thread_local WandEnv *env;
+
+// Dedicated worker threads for image jobs so they do not compete with fs, dns and zlib in the libuv pool,
+// shared by all environments and by the 8 and 16-bit modules, see usePool
+struct WandPool {
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    deque<WandWork*> queue;
+    // Jobs waiting for the memory budget
+    deque<WandWork*> held;
+    int workers;
+    int threads;
+    int running;
+    int active;
+    int max_queue;
+    int pending;
+    int64_t budget;
+    int64_t used;
+    // Structure sizes of the module that owns the pool, another module can only share it if they are the same
+    size_t layout[3];
+};
+
+static WandPool wandPool;
+static WandPool *pool = &wandPool;
+
+// Environments with the module loaded, ImageMagick is initialized by the first and released by the last one
+static pthread_mutex_t wandEnvsLock = PTHREAD_MUTEX_INITIALIZER;
+static int wandEnvs;
+
+static int bkGetCores()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// ImageMagick thread limit is process wide, it is the share of one job so that all workers busy do not use more
+// than all cores, every OpenMP loop of every job uses up to this many threads
+static void bkSetPoolThreads()
+{
+    int threads = pool->threads > 0 ? pool->threads : bkGetCores() / pool->workers;
+    MagickSetResourceLimit(ThreadResource, threads > 0 ? threads : 1);
+}
+
+// Reserve the job memory from the budget, jobs that do not fit now are held, jobs that never fit fail with UV_E2BIG
+static bool bkAdmitWork(WandWork *req)
+{
+    req->reserved = 0;
+    if (!pool->budget || req->cost <= 0) return true;
+    if (req->cost > pool->budget) {
+        req->status = UV_E2BIG;
+        req->env->done.push_back(req);
+        uv_async_send(&req->env->async);
+        return false;
     }
-    str = MagickGetImageFormat(wand);
-    if (str) {
-        baton->o.ext = str;
-        free(str);
+    if (pool->used && pool->used + req->cost > pool->budget) {
+        pool->held.push_back(req);
+        return false;
     }
-    std::transform(baton->o.ext.begin(), baton->o.ext.end(), baton->o.ext.begin(), ::tolower);
-    if (baton->o.ext == "jpeg") baton->o.ext = "jpg";
+    req->reserved = req->cost;
+    pool->used += req->reserved;
+    return true;
+}
 
-    // Skip animated GIF modifications until implemented properly
-    if (frames <= 1 || baton->d.no_animation) {
-        // Use the only the specified frame, -1 for converting all TODO
-        if (frames > 1 && baton->d.frame >= 0) {
-            MagickWand *lwand = MagickCoalesceImages(wand);
-            if (!lwand) goto err;
-            DestroyMagickWand(wand);
-            wand = lwand;
-            status = MagickSetIteratorIndex(wand, baton->d.frame);
-            if (status == MagickFalse) goto err;
-            frames = 1;
-        }
+// Held jobs are checked again before new ones
+static void bkResumeWork()
+{
+    while (!pool->held.empty()) {
+        pool->queue.push_front(pool->held.back());
+        pool->held.pop_back();
+    }
+    uv_cond_broadcast(&pool->cond);
+}
 
-        if (baton->d.rotate) {
-            PixelWand *bg = NewPixelWand();
-            PixelSetColor(bg, baton->bgcolor.c_str());
-            status = MagickRotateImage(wand, bg, baton->d.rotate);
-            DestroyPixelWand(bg);
-            if (status == MagickFalse) goto err;
-            // Have to strip because EXIF data is always preserved
-            baton->d.orientation = 0;
-            baton->d.strip = 1;
-        } else
-        if (baton->bgcolor.size()) {
-            PixelWand *bg = NewPixelWand();
-            PixelSetColor(bg, baton->bgcolor.c_str());
-            status = MagickSetImageBackgroundColor(wand, bg);
-            DestroyPixelWand(bg);
-            if (status == MagickFalse) goto err;
-            MagickWand *nwand = MagickMergeImageLayers(wand, FlattenLayer);
-            if (nwand) {
-                DestroyMagickWand(wand);
-                wand = nwand;
-            }
-        }
-        int width = MagickGetImageWidth(wand);
-        int height = MagickGetImageHeight(wand);
+// Returns UV_ECANCELED or UV_ETIMEDOUT if the job must stop
+static int bkWorkStatus(WandWork *req)
+{
+    if (req->cancelled) return UV_ECANCELED;
+    if (req->deadline && uv_hrtime() > req->deadline) return UV_ETIMEDOUT;
+    return 0;
+}
 
-        if (baton->d.crop_width && baton->d.crop_height) {
-            status = MagickCropImage(wand, baton->d.crop_width, baton->d.crop_height, baton->d.crop_x, baton->d.crop_y);
-            if (status == MagickFalse) goto err;
+static void bkWorkerThread(void *arg)
+{
+    pthread_detach(pthread_self());
+    uv_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->queue.empty() && pool->running <= pool->workers) uv_cond_wait(&pool->cond, &pool->lock);
+        // Exit if the pool has been shrunk
+        if (pool->running > pool->workers) break;
+        WandWork *req = pool->queue.front();
+        pool->queue.pop_front();
+        // Expired while waiting in the queue
+        req->status = bkWorkStatus(req);
+        if (req->status) {
+            req->env->done.push_back(req);
+            uv_async_send(&req->env->async);
+            continue;
         }
-        // Negative width or height means we should not upscale if the image is already below the given dimensions
-        if (baton->d.width < 0) {
-            baton->d.width *= -1;
-            if (width <= baton->d.width) baton->d.width = 0;
+        pool->active++;
+        if (pool->budget && req->cost_cb && req->cost < 0) {
+            uv_mutex_unlock(&pool->lock);
+            int64_t cost = req->cost_cb(req);
+            uv_mutex_lock(&pool->lock);
+            req->cost = cost;
         }
-        if (baton->d.height < 0) {
-            baton->d.height *= -1;
-            if (height <= baton->d.height) baton->d.height = 0;
+        if (!bkAdmitWork(req)) {
+            pool->active--;
+            continue;
         }
+        uv_mutex_unlock(&pool->lock);
 
-        // Keep the aspect if no dimensions given
-        if (baton->d.height == 0 || baton->d.width == 0) {
-            float aspectRatio = (width * 1.0)/height;
-            if (baton->d.height == 0) baton->d.height = baton->d.width * (1.0/aspectRatio); else
-                if (baton->d.width == 0) baton->d.width = baton->d.height * aspectRatio;
-        }
+        req->work_cb(req);
 
-        if (baton->d.colorspace != UndefinedColorspace) {
-            status = MagickSetImageColorspace(wand, baton->d.colorspace);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.gravity != UndefinedGravity) {
-            status = MagickSetImageGravity(wand, baton->d.gravity);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.opacity) {
-            status = MagickSetImageAlpha(wand, baton->d.opacity);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.normalize) {
-            status = MagickNormalizeImage(wand);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.posterize) {
-            status = MagickPosterizeImage(wand, baton->d.posterize, baton->d.dither);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.quantize) {
-            status = MagickQuantizeImage(wand, baton->d.quantize, RGBColorspace, baton->d.tree_depth, baton->d.dither, (MagickBooleanType)0);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.flip) {
-            status = MagickFlipImage(wand);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.flop) {
-            status = MagickFlopImage(wand);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.width && baton->d.height) {
-            status = MagickResizeImage(wand, baton->d.width, baton->d.height, baton->filter);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.blur_radius || baton->d.blur_sigma) {
-            status = MagickAdaptiveBlurImage(wand, baton->d.blur_radius, baton->d.blur_sigma);
-            if (status == MagickFalse) goto err;
-        }
-        if (baton->d.brightness || baton->d.contrast) {
-#ifdef JincFilter
-            status = MagickBrightnessContrastImage(wand, baton->d.brightness, baton->d.contrast);
-            if (status == MagickFalse) goto err;
-#endif
-        }
-        if (baton->d.sharpen_radius || baton->d.sharpen_sigma) {
-            status = MagickAdaptiveSharpenImage(wand, baton->d.sharpen_radius, baton->d.sharpen_sigma);
-            if (status == MagickFalse) goto err;
+        uv_mutex_lock(&pool->lock);
+        // Helper jobs have no environment and no completion
+        if (!req->env) {
+            pool->active--;
+            delete req;
+            continue;
         }
-        if (baton->d.strip) {
-            status = MagickStripImage(wand);
-            if (status == MagickFalse) goto err;
-        }
-        const char *fmt = baton->format.c_str();
-        while (fmt && *fmt && *fmt == '.') fmt++;
-        if (fmt && *fmt) {
-            MagickSetImageFormat(wand, fmt);
-        }
-        if (baton->d.quality <= 100) {
-            MagickSetImageCompressionQuality(wand, baton->d.quality);
+        // The result is not needed anymore
+        req->status = bkWorkStatus(req);
+        pool->active--;
+        req->env->done.push_back(req);
+        uv_async_send(&req->env->async);
+        if (req->reserved) {
+            pool->used -= req->reserved;
+            req->reserved = 0;
+            bkResumeWork();
         }
     }
-    // Output info about the new or unmodified image
-    baton->d.width = MagickGetImageWidth(wand);
-    baton->d.height = MagickGetImageHeight(wand);
-    str = MagickGetImageFormat(wand);
-    if (str) {
-        baton->ext = str;
-        free(str);
+    pool->running--;
+    uv_mutex_unlock(&pool->lock);
+}
+
+static void bkCloseEnv(WandEnv *e);
+
+// Runs completion callbacks on the event loop thread of the environment
+static void bkAfterWork(uv_async_t *handle)
+{
+    WandEnv *e = (WandEnv *)handle->data;
+    deque<WandWork*> done;
+    uv_mutex_lock(&pool->lock);
+    done.swap(e->done);
+    uv_mutex_unlock(&pool->lock);
+
+    for (uint i = 0; i < done.size(); i++) {
+        WandWork *req = done[i];
+        e->pending--;
+        // The id is kept so a job queued again by its callback can still be cancelled by it
+        if (req->id) e->jobs.erase(req->id);
+        req->after_cb(req, req->status);
     }
-    // File extension, lowercase and 3 letters only
-    std::transform(baton->ext.begin(), baton->ext.end(), baton->ext.begin(), ::tolower);
-    if (baton->ext == "jpeg") baton->ext = "jpg";
+    if (e->pending) return;
+    uv_unref((uv_handle_t*)&e->async);
+    if (e->closing) bkCloseEnv(e);
+}
 
-    if (baton->out.size()) {
-        // Make sure all subdirs exist
-        if (bkMakePath(baton->out)) {
-            string::size_type dot = baton->out.find_last_of('.');
-            if (dot != string::npos) baton->out = baton->out.substr(0, dot);
-            baton->out += "." + baton->ext;
+// Submit a job to the pool, if the queue is full the job is completed with UV_EBUSY status
+static int bkQueueWork(WandWork *req, wand_work_cb work_cb, wand_after_work_cb after_cb)
+{
+    req->env = env;
+    req->work_cb = work_cb;
+    req->after_cb = after_cb;
+    req->status = 0;
+    if (!env->pending++) uv_ref((uv_handle_t*)&env->async);
+    if (!req->id) {
+        if (!++env->next_id) env->next_id++;
+        req->id = env->next_id;
+    }
+    env->jobs[req->id] = req;
 
-            if (frames > 1) {
-                status = MagickWriteImages(wand, baton->out.c_str(), MagickTrue);
-            } else {
-                status = MagickWriteImage(wand, baton->out.c_str());
-            }
-            if (status == MagickFalse) goto err;
-        } else {
-            baton->err = errno;
-        }
+    uv_mutex_lock(&pool->lock);
+    while (pool->running < pool->workers) {
+        uv_thread_t tid;
+        if (uv_thread_create(&tid, bkWorkerThread, NULL)) break;
+        pool->running++;
+    }
+    if (pool->max_queue > 0 && (int)(pool->queue.size() + pool->held.size()) >= pool->max_queue) {
+        req->status = UV_EBUSY;
+        env->done.push_back(req);
+        uv_async_send(&env->async);
     } else {
-        if (frames > 1) {
-            baton->image = MagickGetImagesBlob(wand, &baton->length);
-        } else {
-            baton->image = MagickGetImageBlob(wand, &baton->length);
-        }
-        if (!baton->image) goto err;
+        pool->queue.push_back(req);
+        uv_cond_signal(&pool->cond);
     }
-    DestroyMagickWand(wand);
-    return;
-err:
-    baton->exception = MagickGetException(wand, &severity);
-    DestroyMagickWand(wand);
+    uv_mutex_unlock(&pool->lock);
+    return req->status;
 }
 
-static void afterResizeImage(uv_work_t *req)
+// Queue helper jobs from a running job, they go before other jobs to finish the running one sooner,
+// the worker frees them once done
+static void bkQueueHelpers(wand_work_cb work_cb, void *data, int count)
 {
-    Nan::HandleScope scope;
-    MagickBaton *baton = (MagickBaton *)req->data;
+    uv_mutex_lock(&pool->lock);
+    for (int i = 0; i < count; i++) {
+        WandWork *req = new WandWork;
+        req->work_cb = work_cb;
+        req->data = data;
+        pool->queue.push_front(req);
+    }
+    uv_cond_broadcast(&pool->cond);
+    uv_mutex_unlock(&pool->lock);
+}
 
-    Local<Value> argv[3];
+// Complete a job without running it, the callback is still called asynchronously
+static void bkCompleteWork(WandWork *req, wand_after_work_cb after_cb, int status)
+{
+    req->env = env;
+    req->after_cb = after_cb;
+    req->status = status;
+    if (!env->pending++) uv_ref((uv_handle_t*)&env->async);
 
-    if (!baton->cb.IsEmpty()) {
-        Local<Function> cb = Nan::New(baton->cb);
-        if (baton->err || baton->exception) {
-            argv[0] = Nan::Error(baton->err ? strerror(baton->err) : baton->exception);
-            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
-        } else {
-            Local<Object> info = Nan::New<Object>();
-            Nan::Set(info, Nan::New("ext").ToLocalChecked(), Nan::New(baton->ext).ToLocalChecked());
-            if (baton->out.size()) Nan::Set(info, Nan::New("file").ToLocalChecked(), Nan::New(baton->out).ToLocalChecked());
-            if (baton->d.orientation) {
-                Nan::Set(info, Nan::New("orientation").ToLocalChecked(), Nan::New(getMagickOrientation(baton->d.orientation)).ToLocalChecked());
-                Nan::Set(info, Nan::New("rotation").ToLocalChecked(), Nan::New(getMagickAngle(baton->d.orientation)));
-            }
-            Nan::Set(info, Nan::New("width").ToLocalChecked(), Nan::New(baton->d.width));
-            Nan::Set(info, Nan::New("height").ToLocalChecked(), Nan::New(baton->d.height));
-            Nan::Set(info, Nan::New("_width").ToLocalChecked(), Nan::New(baton->o.width));
-            Nan::Set(info, Nan::New("_height").ToLocalChecked(), Nan::New(baton->o.height));
-            if (baton->o.ext.size()) Nan::Set(info, Nan::New("_ext").ToLocalChecked(), Nan::New(baton->o.ext).ToLocalChecked());
-            if (baton->o.orientation) {
-                Nan::Set(info, Nan::New("_orientation").ToLocalChecked(), Nan::New(getMagickOrientation(baton->o.orientation)).ToLocalChecked());
-                Nan::Set(info, Nan::New("_rotation").ToLocalChecked(), Nan::New(getMagickAngle(baton->o.orientation)));
-            }
-            if (baton->image) {
-                argv[0] = Nan::Null();
-                argv[1] = Nan::CopyBuffer((const char*)baton->image, baton->length).ToLocalChecked();
-                argv[2] = info;
-                NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 3, argv);
-            } else {
-                argv[0] = Nan::Null();
-                argv[1] = Nan::Null();
-                argv[2] = info;
-                NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 3, argv);
-            }
-        }
+    uv_mutex_lock(&pool->lock);
+    env->done.push_back(req);
+    uv_async_send(&env->async);
+    uv_mutex_unlock(&pool->lock);
+}
+
+// Error message for the job status
+static const char *bkStrStatus(int status)
+{
+    switch (status) {
+    case UV_EBUSY:
+        return "image queue is full";
+    case UV_E2BIG:
+        return "image does not fit into the memory budget";
+    case UV_ECANCELED:
+        return "image job cancelled";
+    case UV_ETIMEDOUT:
+        return "image job timed out";
+    default:
+        return uv_strerror(status);
     }
-    if (baton->image) MagickRelinquishMemory(baton->image);
-    if (baton->exception) MagickRelinquishMemory(baton->exception);
-    delete baton;
-    delete req;
 }
 
-static NAN_METHOD(resizeImage)
+static bool cancelMagickCache(WandWork *req);
+
+// Remove a waiting job or tell the running job to stop, returns false if the job is not queued or running,
+// a finished job waiting for its callback is not cancelled
+static bool bkCancelWork(uint32_t id)
 {
-    NAN_REQUIRE_ARGUMENT(0);
-    NAN_REQUIRE_ARGUMENT_OBJECT(1, opts);
+    unordered_map<uint32_t, WandWork*>::iterator it = env->jobs.find(id);
+    if (it == env->jobs.end()) return false;
+    WandWork *req = it->second;
+    if (cancelMagickCache(req)) return true;
 
-    uv_work_t *req = new uv_work_t;
-    MagickBaton *baton = new MagickBaton;
-    req->data = baton;
-    if (info.Length() > 2 && info[2]->IsFunction()) {
-        baton->cb.Reset(Local<Function>::Cast(info[2]));
+    uv_mutex_lock(&pool->lock);
+    if (std::find(env->done.begin(), env->done.end(), req) != env->done.end()) {
+        uv_mutex_unlock(&pool->lock);
+        return false;
     }
-
-    const Local<Array> names = Nan::GetPropertyNames(opts).ToLocalChecked();
-    for (uint i = 0 ; i < names->Length(); ++i) {
-        Nan::Utf8String key(Nan::Get(names, i).ToLocalChecked());
-        Nan::Utf8String val(Nan::Get(opts, Nan::Get(names, i).ToLocalChecked()).ToLocalChecked());
-        if (!strcmp(*key, "posterize")) baton->d.posterize = atoi(*val); else
-        if (!strcmp(*key, "dither")) baton->d.dither = (DitherMethod)atoi(*val); else
-        if (!strcmp(*key, "normalize")) baton->d.normalize = (DitherMethod)atoi(*val); else
-        if (!strcmp(*key, "quantize")) baton->d.quantize = atoi(*val); else
-        if (!strcmp(*key, "treedepth")) baton->d.tree_depth = atoi(*val); else
-        if (!strcmp(*key, "flip")) baton->d.flip = atoi(*val); else
-        if (!strcmp(*key, "strip")) baton->d.strip = atoi(*val); else
-        if (!strcmp(*key, "flop")) baton->d.flop = atoi(*val); else
-        if (!strcmp(*key, "width")) baton->d.width = atoi(*val); else
-        if (!strcmp(*key, "height")) baton->d.height = atoi(*val); else
-        if (!strcmp(*key, "quality")) baton->d.quality = atoi(*val); else
-        if (!strcmp(*key, "blur_radius")) baton->d.blur_radius = atof(*val); else
-        if (!strcmp(*key, "blur_sigma")) baton->d.blur_sigma = atof(*val); else
-        if (!strcmp(*key, "sharpen_radius")) baton->d.sharpen_radius = atof(*val); else
-        if (!strcmp(*key, "sharpen_sigma")) baton->d.sharpen_sigma = atof(*val); else
-        if (!strcmp(*key, "brightness")) baton->d.brightness = atof(*val); else
-        if (!strcmp(*key, "contrast")) baton->d.contrast = atof(*val); else
-        if (!strcmp(*key, "rotate")) baton->d.rotate = atof(*val); else
-        if (!strcmp(*key, "no_animation")) baton->d.no_animation = atof(*val); else
-        if (!strcmp(*key, "frame")) baton->d.frame = atof(*val); else
-        if (!strcmp(*key, "opacity")) baton->d.rotate = atof(*val); else
-        if (!strcmp(*key, "crop_width")) baton->d.crop_width = atoi(*val); else
-        if (!strcmp(*key, "crop_height")) baton->d.crop_height = atoi(*val); else
-        if (!strcmp(*key, "crop_x")) baton->d.crop_x = atoi(*val); else
-        if (!strcmp(*key, "crop_y")) baton->d.crop_y = atoi(*val); else
-        if (!strcmp(*key, "bgcolor")) baton->bgcolor = *val; else
-        if (!strcmp(*key, "outfile")) baton->out = *val; else
-        if (!strcmp(*key, "ext")) baton->format = *val; else
-        if (!strcmp(*key, "filter")) baton->filter = getMagickFilter(*val); else
-        if (!strcmp(*key, "gravity")) baton->d.gravity = getMagickGravity(*val);
-        if (!strcmp(*key, "colorspace")) baton->d.colorspace = getMagickColorspace(*val);
-    }
-
-    // If a Buffer passed we use it as a source for image
-    if (info[0]->IsObject()) {
-        Local<Object> buf = Nan::To<Object>(info[0]).ToLocalChecked();
-        baton->length = Buffer::Length(buf);
-        baton->image = (unsigned char*)malloc(baton->length);
-        memcpy(baton->image, Buffer::Data(buf), baton->length);
+    req->cancelled = true;
+    deque<WandWork*>::iterator q = std::find(pool->queue.begin(), pool->queue.end(), req);
+    bool found = q != pool->queue.end();
+    if (found) {
+        pool->queue.erase(q);
     } else {
-        // Otherwise read form file
-        Nan::Utf8String name(info[0]);
-        baton->path = *name;
+        q = std::find(pool->held.begin(), pool->held.end(), req);
+        found = q != pool->held.end();
+        if (found) pool->held.erase(q);
     }
+    if (found) {
+        req->status = UV_ECANCELED;
+        env->done.push_back(req);
+        uv_async_send(&env->async);
+    }
+    uv_mutex_unlock(&pool->lock);
+    return true;
+}
 
-    uv_queue_work(uv_default_loop(), req, doResizeImage, (uv_after_work_cb)afterResizeImage);
+static void bkInitPool()
+{
+    uv_mutex_init(&pool->lock);
+    uv_cond_init(&pool->cond);
+    pool->workers = 4;
+    pool->layout[0] = sizeof(WandPool);
+    pool->layout[1] = sizeof(WandWork);
+    pool->layout[2] = sizeof(WandEnv);
 }
 
-static NAN_MODULE_INIT(WandInit)
+// Create the state of the calling environment, the first one initializes ImageMagick
+static WandEnv *bkInitEnv(uv_loop_t *loop)
 {
-    MagickWandGenesis();
-    NAN_EXPORT(target, resizeImage);
+    pthread_mutex_lock(&wandEnvsLock);
+    if (!wandEnvs++) {
+        MagickWandGenesis();
+        uv_mutex_lock(&pool->lock);
+        bkSetPoolThreads();
+        uv_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&wandEnvsLock);
+
+    env = new WandEnv;
+    env->loop = loop;
+    env->async.data = env;
+    uv_async_init(loop, &env->async, bkAfterWork);
+    uv_unref((uv_handle_t*)&env->async);
+    return env;
 }
-#else
-static NAN_MODULE_INIT(WandInit)
+
+// Cancel all jobs of the environment, it is closed once all of them are completed
+static void bkStopEnv(WandEnv *e)
 {
+    e->closing = true;
+    vector<uint32_t> ids;
+    for (unordered_map<uint32_t, WandWork*>::iterator it = e->jobs.begin(); it != e->jobs.end(); ++it) ids.push_back(it->first);
+    for (uint i = 0; i < ids.size(); i++) bkCancelWork(ids[i]);
+    if (!e->pending) bkCloseEnv(e);
 }
+
+static void freeMagickImage(MagickBaton *baton);
+
+static void bkFreeEnv(uv_handle_t *handle)
+{
+    WandEnv *e = (WandEnv *)handle->data;
+    while (e->cache.lru.size()) {
+        freeMagickImage(e->cache.lru.back());
+        delete e->cache.lru.back();
+        e->cache.lru.pop_back();
+    }
+#ifndef WAND_NO_NODE
+    e->preset.Reset();
 #endif
+    if (e->close_cb) e->close_cb(e->close_arg);
+    if (env == e) env = NULL;
+    delete e;
+
+    pthread_mutex_lock(&wandEnvsLock);
+    if (!--wandEnvs) MagickWandTerminus();
+    pthread_mutex_unlock(&wandEnvsLock);
+}
+
+static void bkCloseEnv(WandEnv *e)
+{
+    uv_close((uv_handle_t*)&e->async, bkFreeEnv);
+}
+
+// ImageMagick copies a pipe into a temporary file to detect the format, a known format is decoded from the pipe directly
+static void setMagickStreamFormat(MagickBaton *baton, MagickWand *wand)
+{
+    if (baton->in.ext.empty()) return;
+    string name = baton->in.ext + ":";
+    MagickSetFilename(wand, name.c_str());
+}
+
+// Descriptor source that can be read only once, the header is not known before decoding
+static bool isMagickStream(MagickBaton *baton)
+{
+    return baton->fd >= 0 && baton->fd_offset < 0;
+}
+
+// Regular files given by descriptor are read by a copy from the start offset so they can be pinged and read again
+// like files given by name, other descriptors are consumed
+static FILE *openMagickFd(MagickBaton *baton)
+{
+    if (baton->fd_offset < 0) return bkOpenFd(baton->fd, "rb");
+    int fd = fcntl(baton->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) return NULL;
+    if (lseek(fd, baton->fd_offset, SEEK_SET) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    return bkOpenFd(fd, "rb");
+}
+
+// Read image properties from the header without decoding pixels, all frames are counted for the pixel cache estimate
+static MagickBooleanType pingMagickImage(MagickBaton *baton, MagickWand *wand)
+{
+    MagickBooleanType status;
+    char *str;
+
+    // Raw pixels have no header
+    if (baton->in.width) {
+        baton->o.frames = 1;
+        baton->o.width = baton->in.width;
+        baton->o.height = baton->in.height;
+        baton->o.pixels = (double)baton->in.width * baton->in.height;
+        baton->o.alpha = baton->in.layout.find_first_of("AO") != string::npos;
+        baton->o.ext = "raw";
+        baton->o.colorspace = baton->in.layout == "I" ? "gray" : baton->in.layout.find('K') != string::npos ? "cmyk" : "srgb";
+        return MagickTrue;
+    }
+    if (baton->blob) {
+        status = MagickPingImageBlob(wand, baton->blob, baton->blob_length);
+    } else
+    if (baton->fd >= 0) {
+        // A stream is consumed, only for probeImage
+        FILE *fp = openMagickFd(baton);
+        if (!fp) return MagickFalse;
+        setMagickStreamFormat(baton, wand);
+        status = MagickPingImageFile(wand, fp);
+        fclose(fp);
+    } else {
+        status = MagickPingImage(wand, baton->path.c_str());
+    }
+    if (status == MagickFalse) return status;
 
-NODE_MODULE(binding, WandInit);
+    baton->o.frames = MagickGetNumberImages(wand);
+    baton->o.pixels = 0;
+    MagickResetIterator(wand);
+    while (MagickNextImage(wand)) baton->o.pixels += (double)MagickGetImageWidth(wand) * MagickGetImageHeight(wand);
+    MagickSetFirstIterator(wand);
+    baton->o.width = MagickGetImageWidth(wand);
+    baton->o.height = MagickGetImageHeight(wand);
+    baton->o.alpha = MagickGetImageAlphaChannel(wand);
+    str = MagickGetImageProperty(wand, "exif:Orientation");
+    if (str) {
+        baton->o.orientation = atoi(str);
+        free(str);
+    }
+    str = MagickGetImageFormat(wand);
+    if (str) {
+        baton->o.ext = str;
+        free(str);
+    }
+    std::transform(baton->o.ext.begin(), baton->o.ext.end(), baton->o.ext.begin(), ::tolower);
+    if (baton->o.ext == "jpeg") baton->o.ext = "jpg";
+    const char *cs = CommandOptionToMnemonic(MagickColorspaceOptions, MagickGetImageColorspace(wand));
+    if (cs) {
+        baton->o.colorspace = cs;
+        std::transform(baton->o.colorspace.begin(), baton->o.colorspace.end(), baton->o.colorspace.begin(), ::tolower);
+    }
+    return MagickTrue;
+}
+
+// JPEG 2000 codestreams keep lower resolution levels and decode any region of the reference grid
+static bool isMagickJp2(const string &ext)
+{
+    return ext == "jp2" || ext == "j2k" || ext == "j2c" || ext == "jpc" || ext == "jpt" || ext == "jpm";
+}
+
+// Smallest size the JPEG decoder can produce with DCT scaling or the JPEG 2000 decoder with resolution reduction
+// that is not smaller than the target dimensions, the header is pinged first to get the real format and dimensions
+// which are reported as the original ones
+static bool getMagickDecodeSize(MagickBaton *baton, int &w, int &h)
+{
+    if (!baton->d.shrink || (!baton->d.width && !baton->d.height)) return false;
+    // Crop coordinates are rescaled unless the exact order is required
+    bool crop = baton->d.crop_width > 0 && baton->d.crop_height > 0;
+    if (crop && baton->d.strict) return false;
+    // Only right angles keep the source dimensions
+    int angle = (int)baton->d.rotate;
+    if (angle != baton->d.rotate || angle % 90) return false;
+    // Streams cannot be read twice for the header
+    if (isMagickStream(baton)) return false;
+
+    if (!baton->o.frames) {
+        MagickWand *pwand = NewMagickWand();
+        pingMagickImage(baton, pwand);
+        DestroyMagickWand(pwand);
+    }
+    int width = baton->o.width;
+    int height = baton->o.height;
+    if ((baton->o.ext != "jpg" && !isMagickJp2(baton->o.ext)) || width <= 0 || height <= 0) return false;
+
+    if (angle % 180) std::swap(width, height);
+    w = abs(baton->d.width), h = abs(baton->d.height);
+    if (!w) w = h * ((width * 1.0)/height);
+    if (!h) h = w * ((height * 1.0)/width);
+    // Only the cropped region must not be smaller than the target
+    if (crop) {
+        w = ceil(w * (width * 1.0)/baton->d.crop_width);
+        h = ceil(h * (height * 1.0)/baton->d.crop_height);
+    }
+    // The smallest DCT scale and resolution level is 1/2
+    if (width < w * 2 || height < h * 2) return false;
+    if (angle % 180) std::swap(w, h);
+    return true;
+}
+
+// Wavelet decomposition levels of a JPEG 2000 codestream or JP2 file from the COD and COC markers of the main header,
+// the lowest of all components, -1 if not found within the given bytes
+static int bkJp2Levels(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+    // JP2 file boxes up to the contiguous codestream box
+    if (len >= 12 && !memcmp(p + 4, "jP  ", 4)) {
+        while (1) {
+            if (i + 8 > len) return -1;
+            uint64_t size = (uint64_t)p[i] << 24 | p[i + 1] << 16 | p[i + 2] << 8 | p[i + 3];
+            size_t hdr = 8;
+            if (size == 1) {
+                if (i + 16 > len) return -1;
+                size = 0;
+                for (int j = 0; j < 8; j++) size = size << 8 | p[i + 8 + j];
+                hdr = 16;
+            }
+            if (!memcmp(p + i + 4, "jp2c", 4)) {
+                i += hdr;
+                break;
+            }
+            if (size < hdr || size > len - i) return -1;
+            i += size;
+        }
+    }
+    if (i + 2 > len || p[i] != 0xFF || p[i + 1] != 0x4F) return -1;
+    i += 2;
+
+    int levels = -1, components = 0;
+    while (i + 4 <= len && p[i] == 0xFF) {
+        int marker = p[i + 1];
+        size_t size = p[i + 2] << 8 | p[i + 3];
+        // The first tile starts, the main header is over
+        if (marker == 0x90 || marker == 0x93 || size < 2 || i + 2 + size > len) break;
+        const unsigned char *m = p + i + 4;
+        // SIZ: number of components decides the size of the component index in COC
+        if (marker == 0x51 && size >= 38) components = m[34] << 8 | m[35];
+        // COD: Scod, progression order, layers, MCT, then the number of levels
+        if (marker == 0x52 && size >= 12) levels = levels < 0 ? m[5] : min(levels, (int)m[5]);
+        // COC: component index, Scoc, then the number of levels of this component
+        if (marker == 0x53 && components) {
+            size_t c = components < 257 ? 1 : 2;
+            if (size >= 2 + c + 2) levels = levels < 0 ? m[c + 1] : min(levels, (int)m[c + 1]);
+        }
+        i += 2 + size;
+    }
+    return levels;
+}
+
+// Decomposition levels of the source, only the first bytes of a file are read, the main header is near the start
+static int getMagickJp2Levels(MagickBaton *baton)
+{
+    if (baton->blob) return bkJp2Levels(baton->blob, baton->blob_length);
+    unsigned char buf[65536];
+    if (baton->fd >= 0) {
+        ssize_t len = pread(baton->fd, buf, sizeof(buf), baton->fd_offset);
+        return len > 0 ? bkJp2Levels(buf, len) : -1;
+    }
+    FILE *fp = fopen(baton->path.c_str(), "rb");
+    if (!fp) return -1;
+    size_t len = fread(buf, 1, sizeof(buf), fp);
+    fclose(fp);
+    return bkJp2Levels(buf, len);
+}
+
+// Ask the JPEG decoder for a DCT scaled image or the JPEG 2000 decoder to skip the highest resolution levels
+static bool setMagickDecodeSize(MagickBaton *baton, MagickWand *wand)
+{
+    int w, h;
+    if (!getMagickDecodeSize(baton, w, h)) return false;
+    char size[64];
+    if (baton->o.ext == "jpg") {
+        snprintf(size, sizeof(size), "%dx%d", w, h);
+        MagickSetOption(wand, "jpeg:size", size);
+        return true;
+    }
+    // Each level halves both dimensions, OpenJPEG fails if the factor is above the number of levels, encoders
+    // use 5 by default
+    int levels = getMagickJp2Levels(baton);
+    if (levels < 0) levels = 5;
+    int reduce = 0;
+    while (reduce < levels && (baton->o.width >> (reduce + 1)) >= w && (baton->o.height >> (reduce + 1)) >= h) reduce++;
+    if (!reduce) return false;
+    snprintf(size, sizeof(size), "%d", reduce);
+    MagickSetOption(wand, "jp2:reduce-factor", size);
+    return true;
+}
+
+// Decode only the crop region of a JPEG 2000 image, the crop must run first on the source pixels so
+// rotation is not allowed, returns false if the whole image is read
+static bool setMagickDecodeRegion(MagickBaton *baton, MagickWand *wand)
+{
+    if (baton->d.crop_width <= 0 || baton->d.crop_height <= 0 || baton->d.rotate || isMagickStream(baton)) return false;
+    if (!baton->o.frames) {
+        MagickWand *pwand = NewMagickWand();
+        pingMagickImage(baton, pwand);
+        DestroyMagickWand(pwand);
+    }
+    if (!isMagickJp2(baton->o.ext) || baton->o.frames != 1) return false;
+    int x = baton->d.crop_x, y = baton->d.crop_y;
+    if (x < 0 || y < 0 || x >= baton->o.width || y >= baton->o.height) return false;
+    int w = min(baton->d.crop_width, baton->o.width - x);
+    int h = min(baton->d.crop_height, baton->o.height - y);
+    char geometry[128];
+    snprintf(geometry, sizeof(geometry), "%dx%d+%d+%d", w, h, x, y);
+    return MagickSetExtract(wand, geometry);
+}
+
+// Estimated pixel cache bytes of the decoded source for the admission control, 0 if not known
+static int64_t getMagickImageCost(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    if (!baton->o.frames && !isMagickStream(baton)) {
+        MagickWand *wand = NewMagickWand();
+        pingMagickImage(baton, wand);
+        DestroyMagickWand(wand);
+    }
+    double pixels = baton->o.pixels;
+    int w, h;
+    // Scaled JPEG is decoded to less than twice the requested size in each dimension
+    if (getMagickDecodeSize(baton, w, h)) pixels = min(pixels, 4.0 * w * h); else
+    // JPEG 2000 crop region is decoded alone
+    if (isMagickJp2(baton->o.ext) && baton->d.crop_width > 0 && baton->d.crop_height > 0 && !baton->d.rotate) {
+        pixels = min(pixels, (double)baton->d.crop_width * baton->d.crop_height);
+    }
+    int channels = baton->o.colorspace == "gray" ? 1 : baton->o.colorspace == "cmyk" ? 4 : 3;
+    if (baton->o.alpha) channels++;
+    return pixels * channels * sizeof(Quantum);
+}
+
+// Import raw pixels, encoded output is PNG unless another format is requested
+static MagickBooleanType readMagickPixels(MagickBaton *baton, MagickWand *wand)
+{
+    size_t size = (size_t)baton->in.width * baton->in.height * baton->in.layout.size() * getMagickStorageSize(baton->in.storage);
+    if (baton->in.width <= 0 || baton->in.height <= 0 || baton->in.layout.empty() || !size || baton->blob_length < size) {
+        baton->exception = AcquireString("invalid raw pixels: data, width, height, layout or storage");
+        baton->severity = OptionError;
+        return MagickFalse;
+    }
+    MagickBooleanType status = MagickConstituteImage(wand, baton->in.width, baton->in.height, baton->in.layout.c_str(), baton->in.storage, baton->blob);
+    if (status) MagickSetImageFormat(wand, "PNG");
+    return status;
+}
+
+// Read the source image into the wand and fill the original image properties
+static MagickBooleanType readMagickSource(MagickBaton *baton, MagickWand *wand)
+{
+    if (baton->blob) return MagickReadImageBlob(wand, baton->blob, baton->blob_length);
+    if (baton->fd < 0) return MagickReadImage(wand, baton->path.c_str());
+    // Streams are decoded while the data arrives, no seeking back
+    FILE *fp = openMagickFd(baton);
+    if (!fp) {
+        baton->err = errno;
+        return MagickFalse;
+    }
+    setMagickStreamFormat(baton, wand);
+    MagickBooleanType status = MagickReadImageFile(wand, fp);
+    fclose(fp);
+    return status;
+}
+
+static MagickBooleanType readMagickImage(MagickBaton *baton, MagickWand *wand, int &frames)
+{
+    MagickBooleanType status;
+    char *str;
+
+    bool sized = !baton->in.width && setMagickDecodeSize(baton, wand);
+    bool region = !baton->in.width && !sized && setMagickDecodeRegion(baton, wand);
+    if (baton->in.width) {
+        status = readMagickPixels(baton, wand);
+        baton->blob = NULL;
+    } else {
+        status = readMagickSource(baton, wand);
+        // Tile-part headers may have fewer levels than the main header, read again at full resolution
+        if (!status && !baton->err && sized && isMagickJp2(baton->o.ext)) {
+            MagickDeleteOption(wand, "jp2:reduce-factor");
+            MagickClearException(wand);
+            status = readMagickSource(baton, wand);
+        }
+        baton->blob = NULL;
+    }
+    frames = MagickGetNumberImages(wand);
+
+    if (status == MagickFalse) return status;
+
+    // Original image properties, may be already set from the header if decoded at reduced size
+    if (!baton->o.width || !baton->o.height) {
+        baton->o.width = MagickGetImageWidth(wand);
+        baton->o.height = MagickGetImageHeight(wand);
+    }
+    // Only single JPEG images are decoded at reduced size, header dimensions of animations are from the first frame
+    baton->scale = frames == 1 && baton->o.width ? MagickGetImageWidth(wand) * 1.0 / baton->o.width : 1;
+    // The image is the crop region already, the crop only resets the page
+    if (region) {
+        baton->scale = 1;
+        baton->d.crop_x = baton->d.crop_y = 0;
+    }
+    str = MagickGetImageProperty(wand, "exif:Orientation");
+    if (str) {
+        baton->d.orientation = baton->o.orientation = atoi(str);
+        free(str);
+    }
+    str = MagickGetImageFormat(wand);
+    if (str) {
+        baton->o.ext = str;
+        free(str);
+    }
+    std::transform(baton->o.ext.begin(), baton->o.ext.end(), baton->o.ext.begin(), ::tolower);
+    if (baton->o.ext == "jpeg") baton->o.ext = "jpg";
+    if (baton->in.width) baton->o.ext = "raw";
+    return MagickTrue;
+}
+
+// Resolve negative and missing target dimensions for the given image size
+static void setMagickTargetSize(MagickBaton *baton, int width, int height)
+{
+    // Negative width or height means we should not upscale if the image is already below the given dimensions
+    if (baton->d.width < 0) {
+        baton->d.width *= -1;
+        if (width <= baton->d.width) baton->d.width = 0;
+    }
+    if (baton->d.height < 0) {
+        baton->d.height *= -1;
+        if (height <= baton->d.height) baton->d.height = 0;
+    }
+
+    // Keep the aspect if no dimensions given
+    if (baton->d.height == 0 || baton->d.width == 0) {
+        float aspectRatio = (width * 1.0)/height;
+        if (baton->d.height == 0) baton->d.height = baton->d.width * (1.0/aspectRatio); else
+            if (baton->d.width == 0) baton->d.width = baton->d.height * aspectRatio;
+    }
+}
+
+// Image operations in the order they are requested
+enum {
+    MagickOpRotate,
+    MagickOpFlatten,
+    MagickOpCrop,
+    MagickOpColorspace,
+    MagickOpGravity,
+    MagickOpOpacity,
+    MagickOpNormalize,
+    MagickOpPosterize,
+    MagickOpQuantize,
+    MagickOpFlip,
+    MagickOpFlop,
+    MagickOpResize,
+    MagickOpBlur,
+    MagickOpBrightness,
+    MagickOpSharpen,
+    MagickOpStrip,
+};
+
+static bool isMagickRightAngle(double angle)
+{
+    return angle == (int)angle && (int)angle % 90 == 0;
+}
+
+// Flips and right angle rotations commute exactly with resizing, color operations only approximately: palettes,
+// histograms and edges differ when run on resampled pixels, they are moved unless reorder is 0
+static bool isMagickOpMovable(MagickBaton *baton, int op)
+{
+    switch (op) {
+    case MagickOpRotate:
+        // Crop coordinates are given for the rotated image
+        return isMagickRightAngle(baton->d.rotate) && !(baton->d.crop_width && baton->d.crop_height);
+    case MagickOpFlip:
+    case MagickOpFlop:
+        return true;
+    case MagickOpColorspace:
+    case MagickOpOpacity:
+    case MagickOpNormalize:
+    case MagickOpPosterize:
+    case MagickOpQuantize:
+        return baton->d.reorder > 0;
+    default:
+        return false;
+    }
+}
+
+// Build the list of operations to run, unless in strict mode operations that commute with
+// resizing are moved after it so they run on fewer pixels
+static vector<int> planMagickOps(MagickBaton *baton)
+{
+    vector<int> ops, after;
+    if (baton->d.rotate) ops.push_back(MagickOpRotate); else
+    if (baton->bgcolor.size()) ops.push_back(MagickOpFlatten);
+    if (baton->d.crop_width && baton->d.crop_height) ops.push_back(MagickOpCrop);
+    if (baton->d.colorspace != UndefinedColorspace) ops.push_back(MagickOpColorspace);
+    if (baton->d.gravity != UndefinedGravity) ops.push_back(MagickOpGravity);
+    if (baton->d.opacity) ops.push_back(MagickOpOpacity);
+    if (baton->d.normalize) ops.push_back(MagickOpNormalize);
+    if (baton->d.posterize) ops.push_back(MagickOpPosterize);
+    if (baton->d.quantize) ops.push_back(MagickOpQuantize);
+    if (baton->d.flip) ops.push_back(MagickOpFlip);
+    if (baton->d.flop) ops.push_back(MagickOpFlop);
+    ops.push_back(MagickOpResize);
+    if (baton->d.blur_radius || baton->d.blur_sigma) ops.push_back(MagickOpBlur);
+    if (baton->d.brightness || baton->d.contrast) ops.push_back(MagickOpBrightness);
+    if (baton->d.sharpen_radius || baton->d.sharpen_sigma) ops.push_back(MagickOpSharpen);
+    if (baton->d.strip || baton->d.rotate) ops.push_back(MagickOpStrip);
+    if (baton->d.strict) return ops;
+
+    vector<int> plan;
+    bool resized = false;
+    for (uint i = 0; i < ops.size(); i++) {
+        if (ops[i] == MagickOpResize) {
+            plan.push_back(ops[i]);
+            plan.insert(plan.end(), after.begin(), after.end());
+            resized = true;
+        } else
+        if (!resized && isMagickOpMovable(baton, ops[i])) {
+            after.push_back(ops[i]);
+        } else {
+            plan.push_back(ops[i]);
+        }
+    }
+    return plan;
+}
+
+static MagickBooleanType runMagickOp(MagickBaton *baton, MagickWand *&wand, int op)
+{
+    MagickBooleanType status = MagickTrue;
+    PixelWand *bg;
+
+    switch (op) {
+    case MagickOpRotate:
+        bg = NewPixelWand();
+        PixelSetColor(bg, baton->bgcolor.c_str());
+        status = MagickRotateImage(wand, bg, baton->d.rotate);
+        DestroyPixelWand(bg);
+        // Have to strip because EXIF data is always preserved
+        baton->d.orientation = 0;
+        break;
+
+    case MagickOpFlatten:
+        bg = NewPixelWand();
+        PixelSetColor(bg, baton->bgcolor.c_str());
+        status = MagickSetImageBackgroundColor(wand, bg);
+        DestroyPixelWand(bg);
+        if (status == MagickTrue) {
+            MagickWand *nwand = MagickMergeImageLayers(wand, FlattenLayer);
+            if (nwand) {
+                DestroyMagickWand(wand);
+                wand = nwand;
+            }
+        }
+        break;
+
+    case MagickOpCrop:
+        // Coordinates are for the original image which may have been decoded at reduced size
+        status = MagickCropImage(wand, baton->d.crop_width * baton->scale, baton->d.crop_height * baton->scale,
+                                 baton->d.crop_x * baton->scale, baton->d.crop_y * baton->scale);
+        break;
+
+    case MagickOpColorspace:
+        status = MagickSetImageColorspace(wand, baton->d.colorspace);
+        break;
+
+    case MagickOpGravity:
+        status = MagickSetImageGravity(wand, baton->d.gravity);
+        break;
+
+    case MagickOpOpacity:
+        status = MagickSetImageAlpha(wand, baton->d.opacity);
+        break;
+
+    case MagickOpNormalize:
+        status = MagickNormalizeImage(wand);
+        break;
+
+    case MagickOpPosterize:
+        status = MagickPosterizeImage(wand, baton->d.posterize, baton->d.dither);
+        break;
+
+    case MagickOpQuantize:
+        status = MagickQuantizeImage(wand, baton->d.quantize, RGBColorspace, baton->d.tree_depth, baton->d.dither, (MagickBooleanType)0);
+        break;
+
+    case MagickOpFlip:
+        status = MagickFlipImage(wand);
+        break;
+
+    case MagickOpFlop:
+        status = MagickFlopImage(wand);
+        break;
+
+    case MagickOpResize:
+        if (baton->d.width && baton->d.height) {
+            status = MagickResizeImage(wand, baton->d.width, baton->d.height, baton->filter);
+        }
+        break;
+
+    case MagickOpBlur:
+        status = MagickAdaptiveBlurImage(wand, baton->d.blur_radius, baton->d.blur_sigma);
+        break;
+
+    case MagickOpBrightness:
+#ifdef JincFilter
+        status = MagickBrightnessContrastImage(wand, baton->d.brightness, baton->d.contrast);
+#endif
+        break;
+
+    case MagickOpSharpen:
+        status = MagickAdaptiveSharpenImage(wand, baton->d.sharpen_radius, baton->d.sharpen_sigma);
+        break;
+
+    case MagickOpStrip:
+        status = MagickStripImage(wand);
+        break;
+    }
+    return status;
+}
+
+static MagickBooleanType transformMagickImage(WandWork *req, MagickBaton *baton, MagickWand *&wand, int &frames);
+
+// Frames of an animation shared by the job and its helper jobs on other pool workers, every one takes the next
+// frame until none are left, released by the last owner
+struct MagickFrames {
+    MagickFrames(): refs(1), next(0), failed(-1), active(0), closed(0) {
+        uv_mutex_init(&lock);
+        uv_cond_init(&cond);
+    }
+    ~MagickFrames() {
+        uv_mutex_destroy(&lock);
+        uv_cond_destroy(&cond);
+    }
+    WandWork *req;
+    MagickBaton *baton;
+    vector<MagickWand*> *list;
+    // Options before any frame is processed, the first frame saves the final options into the baton
+    decltype(MagickBaton::d) d;
+    std::atomic<int> refs;
+    std::atomic<uint> next;
+    std::atomic<int> failed;
+    uv_mutex_t lock;
+    uv_cond_t cond;
+    // Helpers processing frames now, the job waits for them before releasing the frames
+    int active;
+    bool closed;
+};
+
+static void releaseMagickFrames(MagickFrames *f)
+{
+    if (!--f->refs) delete f;
+}
+
+static void runMagickFrames(MagickFrames *f)
+{
+    for (uint i = f->next++; i < f->list->size() && f->failed < 0 && !bkWorkStatus(f->req); i = f->next++) {
+        // Each frame resolves the target size on its own copy of the options
+        MagickBaton fb;
+        fb.d = f->d;
+        fb.o = f->baton->o;
+        fb.filter = f->baton->filter;
+        fb.bgcolor = f->baton->bgcolor;
+        fb.format = f->baton->format;
+        fb.scale = f->baton->scale;
+        int one = 1;
+        MagickWand *&fwand = (*f->list)[i];
+        if (!transformMagickImage(f->req, &fb, fwand, one) ||
+            !MagickSetImagePage(fwand, MagickGetImageWidth(fwand), MagickGetImageHeight(fwand), 0, 0)) {
+            f->failed = i;
+        }
+        if (i == 0) f->baton->d = fb.d;
+    }
+}
+
+// Helper job, does nothing if the job has already finished all frames
+static void doMagickFrames(WandWork *req)
+{
+    MagickFrames *f = (MagickFrames *)req->data;
+    uv_mutex_lock(&f->lock);
+    bool closed = f->closed;
+    if (!closed) f->active++;
+    uv_mutex_unlock(&f->lock);
+    if (!closed) {
+        runMagickFrames(f);
+        uv_mutex_lock(&f->lock);
+        if (!--f->active) uv_cond_signal(&f->cond);
+        uv_mutex_unlock(&f->lock);
+    }
+    releaseMagickFrames(f);
+}
+
+// Coalesce the animation, transform the frames on this and other pool workers and optimize the layers again,
+// frames use idle workers instead of extra threads so all running jobs stay within the cores, every worker runs
+// its frames with the same ImageMagick thread share as any job
+static MagickBooleanType transformMagickFrames(WandWork *req, MagickBaton *baton, MagickWand *&wand, int frames)
+{
+    MagickBooleanType status = MagickTrue;
+
+    if (baton->d.max_frames > 0 && frames > baton->d.max_frames) {
+        baton->exception = AcquireString("too many frames in the image");
+        baton->severity = ResourceLimitError;
+        return MagickFalse;
+    }
+    if (baton->d.max_frame_pixels > 0 && (double)baton->o.width * baton->o.height > baton->d.max_frame_pixels) {
+        baton->exception = AcquireString("image frames are too big");
+        baton->severity = ResourceLimitError;
+        return MagickFalse;
+    }
+
+    MagickWand *cwand = MagickCoalesceImages(wand);
+    if (!cwand) return MagickFalse;
+    DestroyMagickWand(wand);
+    wand = cwand;
+
+    vector<MagickWand*> list;
+    for (int i = 0; i < frames; i++) {
+        MagickSetIteratorIndex(wand, i);
+        list.push_back(MagickGetImage(wand));
+    }
+
+    uv_mutex_lock(&pool->lock);
+    int nworkers = baton->d.frame_threads > 0 ? baton->d.frame_threads : pool->workers;
+    uv_mutex_unlock(&pool->lock);
+    nworkers = max(1, min(nworkers, frames));
+
+    MagickFrames *f = new MagickFrames;
+    f->req = req;
+    f->baton = baton;
+    f->list = &list;
+    f->d = baton->d;
+    f->refs += nworkers - 1;
+    bkQueueHelpers(doMagickFrames, f, nworkers - 1);
+    runMagickFrames(f);
+    // Helpers not started yet find the frames closed
+    uv_mutex_lock(&f->lock);
+    f->closed = true;
+    while (f->active) uv_cond_wait(&f->cond, &f->lock);
+    uv_mutex_unlock(&f->lock);
+    int failed = f->failed;
+    releaseMagickFrames(f);
+
+    if (failed < 0 && bkWorkStatus(req)) status = MagickFalse;
+    if (failed >= 0) {
+        baton->exception = MagickGetException(list[failed], &baton->severity);
+        status = MagickFalse;
+    }
+
+    MagickWand *nwand = NewMagickWand();
+    for (uint i = 0; i < list.size(); i++) {
+        if (status) status = MagickAddImage(nwand, list[i]);
+        DestroyMagickWand(list[i]);
+    }
+    if (status) {
+        MagickWand *owand = MagickOptimizeImageLayers(nwand);
+        if (owand) {
+            DestroyMagickWand(nwand);
+            nwand = owand;
+        }
+        DestroyMagickWand(wand);
+        wand = nwand;
+        MagickSetFirstIterator(wand);
+        const char *fmt = baton->format.c_str();
+        while (*fmt == '.') fmt++;
+        if (*fmt) MagickSetFormat(wand, fmt);
+    } else {
+        DestroyMagickWand(nwand);
+    }
+    return status;
+}
+
+// Apply all requested modifications to the image, the wand can be replaced with a new one
+static MagickBooleanType transformMagickImage(WandWork *req, MagickBaton *baton, MagickWand *&wand, int &frames)
+{
+    MagickBooleanType status;
+
+    // Animated images are returned as is unless no_animation is set
+    if (frames <= 1 || baton->d.no_animation) {
+        // Convert all frames
+        if (frames > 1 && baton->d.frame < 0) {
+            return transformMagickFrames(req, baton, wand, frames);
+        }
+        // Use the only the specified frame
+        if (frames > 1 && baton->d.frame >= 0) {
+            MagickWand *lwand = MagickCoalesceImages(wand);
+            if (!lwand) return MagickFalse;
+            DestroyMagickWand(wand);
+            wand = lwand;
+            status = MagickSetIteratorIndex(wand, baton->d.frame);
+            if (status == MagickFalse) return status;
+            frames = 1;
+        }
+
+        vector<int> ops = planMagickOps(baton);
+        bool sized = false, swapped = false;
+        for (uint i = 0; i < ops.size(); i++) {
+            // Target size is computed from the rotated image before cropping
+            if (!sized && (ops[i] == MagickOpCrop || ops[i] == MagickOpResize)) {
+                int width = MagickGetImageWidth(wand);
+                int height = MagickGetImageHeight(wand);
+                for (uint j = i + 1; j < ops.size(); j++) {
+                    if (ops[j] == MagickOpRotate && (int)baton->d.rotate % 180) swapped = true;
+                }
+                if (swapped) {
+                    setMagickTargetSize(baton, height, width);
+                    std::swap(baton->d.width, baton->d.height);
+                } else {
+                    setMagickTargetSize(baton, width, height);
+                }
+                sized = true;
+            }
+            uint64_t t = uv_hrtime();
+            status = runMagickOp(baton, wand, ops[i]);
+            if (ops[i] == MagickOpResize) baton->t[MagickStageResize] += bkLap(t);
+            if (status == MagickFalse) return status;
+        }
+
+        const char *fmt = baton->format.c_str();
+        while (fmt && *fmt && *fmt == '.') fmt++;
+        if (fmt && *fmt) {
+            MagickSetImageFormat(wand, fmt);
+        }
+        if (baton->d.quality <= 100) {
+            MagickSetImageCompressionQuality(wand, baton->d.quality);
+        }
+    }
+    return MagickTrue;
+}
+
+// Result analysis requested by the analyze option
+static bool isMagickAnalyze(MagickBaton *baton)
+{
+    return baton->d.dhash || baton->d.colors > 0 || baton->d.blurhash_x > 0;
+}
+
+// Difference hash: 9x8 grayscale, a bit is set if the pixel is brighter than its right neighbour
+static string getMagickDHash(MagickWand *wand)
+{
+    unsigned char px[72];
+    MagickWand *w = CloneMagickWand(wand);
+    bool ok = MagickResizeImage(w, 9, 8, TriangleFilter) && MagickExportImagePixels(w, 0, 0, 9, 8, "I", CharPixel, px);
+    DestroyMagickWand(w);
+    if (!ok) return "";
+    uint64_t h = 0;
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) h = (h << 1) | (px[y * 9 + x] > px[y * 9 + x + 1]);
+    }
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+    return hex;
+}
+
+static bool bkCountLarger(const pair<size_t, string> &a, const pair<size_t, string> &b)
+{
+    return a.first > b.first;
+}
+
+// Most frequent colors after quantizing to the given number of colors, as #rrggbb
+static vector<string> getMagickColors(MagickWand *wand, int count)
+{
+    vector<pair<size_t, string> > list;
+    MagickWand *w = CloneMagickWand(wand);
+    if (MagickQuantizeImage(w, count, sRGBColorspace, 0, NoDitherMethod, MagickFalse)) {
+        size_t n = 0;
+        PixelWand **colors = MagickGetImageHistogram(w, &n);
+        for (size_t i = 0; colors && i < n; i++) {
+            char hex[8];
+            snprintf(hex, sizeof(hex), "#%02x%02x%02x", (int)(PixelGetRed(colors[i]) * 255 + 0.5),
+                     (int)(PixelGetGreen(colors[i]) * 255 + 0.5), (int)(PixelGetBlue(colors[i]) * 255 + 0.5));
+            list.push_back(make_pair(PixelGetColorCount(colors[i]), string(hex)));
+        }
+        if (colors) DestroyPixelWands(colors, n);
+    }
+    DestroyMagickWand(w);
+    std::stable_sort(list.begin(), list.end(), bkCountLarger);
+    vector<string> rc;
+    for (uint i = 0; i < list.size() && (int)i < count; i++) rc.push_back(list[i].second);
+    return rc;
+}
+
+static double bkSrgbToLinear(int value)
+{
+    double v = value / 255.0;
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static int bkLinearToSrgb(double value)
+{
+    double v = max(0.0, min(1.0, value));
+    return v <= 0.0031308 ? v * 12.92 * 255 + 0.5 : (1.055 * pow(v, 1 / 2.4) - 0.055) * 255 + 0.5;
+}
+
+static void bkBase83(string &out, int value, int length)
+{
+    static const char *chars = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+    int divisor = 1;
+    for (int i = 1; i < length; i++) divisor *= 83;
+    for (int i = 0; i < length; i++, divisor /= 83) out += chars[(value / divisor) % 83];
+}
+
+// BlurHash placeholder with the given number of horizontal and vertical components, https://blurha.sh
+static string getMagickBlurHash(MagickWand *wand, int cx, int cy)
+{
+    int w = MagickGetImageWidth(wand), h = MagickGetImageHeight(wand);
+    vector<unsigned char> px((size_t)w * h * 3);
+    if (px.empty() || !MagickExportImagePixels(wand, 0, 0, w, h, "RGB", CharPixel, &px[0])) return "";
+    vector<double> lin(px.size());
+    for (uint i = 0; i < px.size(); i++) lin[i] = bkSrgbToLinear(px[i]);
+
+    vector<double> f(cx * cy * 3);
+    for (int j = 0; j < cy; j++) {
+        for (int i = 0; i < cx; i++) {
+            double r = 0, g = 0, b = 0;
+            for (int y = 0; y < h; y++) {
+                double by = cos(M_PI * j * y / h);
+                const double *p = &lin[(size_t)y * w * 3];
+                for (int x = 0; x < w; x++, p += 3) {
+                    double basis = cos(M_PI * i * x / w) * by;
+                    r += basis * p[0];
+                    g += basis * p[1];
+                    b += basis * p[2];
+                }
+            }
+            double scale = (i || j ? 2.0 : 1.0) / (w * h);
+            f[(j * cx + i) * 3] = r * scale;
+            f[(j * cx + i) * 3 + 1] = g * scale;
+            f[(j * cx + i) * 3 + 2] = b * scale;
+        }
+    }
+
+    string hash;
+    bkBase83(hash, (cx - 1) + (cy - 1) * 9, 1);
+    double maxv = 1;
+    if (f.size() > 3) {
+        double actual = 0;
+        for (uint i = 3; i < f.size(); i++) actual = max(actual, fabs(f[i]));
+        int q = max(0, min(82, (int)floor(actual * 166 - 0.5)));
+        maxv = (q + 1) / 166.0;
+        bkBase83(hash, q, 1);
+    } else {
+        bkBase83(hash, 0, 1);
+    }
+    bkBase83(hash, (bkLinearToSrgb(f[0]) << 16) + (bkLinearToSrgb(f[1]) << 8) + bkLinearToSrgb(f[2]), 4);
+    for (uint i = 3; i < f.size(); i += 3) {
+        int q[3];
+        for (int c = 0; c < 3; c++) {
+            double v = f[i + c] / maxv;
+            q[c] = max(0, min(18, (int)floor(copysign(sqrt(fabs(v)), v) * 9 + 9.5)));
+        }
+        bkBase83(hash, q[0] * 19 * 19 + q[1] * 19 + q[2], 2);
+    }
+    return hash;
+}
+
+// Hash, colors and placeholder of the first frame of the result, computed from a copy at most 64x64 pixels
+static void analyzeMagickImage(MagickBaton *baton, MagickWand *wand, int frames)
+{
+    if (!isMagickAnalyze(baton)) return;
+    // The wand may be left at the last frame, a single selected frame is the current one and is kept
+    ssize_t index = MagickGetIteratorIndex(wand);
+    if (frames > 1) MagickSetIteratorIndex(wand, 0);
+    MagickWand *tiny = MagickGetImage(wand);
+    if (frames > 1) MagickSetIteratorIndex(wand, index);
+    if (!tiny) return;
+    int w = MagickGetImageWidth(tiny), h = MagickGetImageHeight(tiny);
+    double scale = min(1.0, 64.0 / max(w, h));
+    w = max(1, (int)(w * scale + 0.5));
+    h = max(1, (int)(h * scale + 0.5));
+    if ((scale >= 1 || MagickResizeImage(tiny, w, h, TriangleFilter)) && MagickSetImageAlphaChannel(tiny, RemoveAlphaChannel)) {
+        if (baton->d.dhash) baton->a.dhash = getMagickDHash(tiny);
+        if (baton->d.colors > 0) baton->a.colors = getMagickColors(tiny, baton->d.colors);
+        if (baton->d.blurhash_x > 0) baton->a.blurhash = getMagickBlurHash(tiny, baton->d.blurhash_x, baton->d.blurhash_y);
+    }
+    DestroyMagickWand(tiny);
+}
+
+// Save encoded data into the output descriptor or the output file with the actual extension
+static void writeMagickFile(MagickBaton *baton, const unsigned char *data, size_t size)
+{
+    FILE *out = NULL;
+    if (baton->out_fd >= 0) {
+        errno = 0;
+        if (!(out = bkOpenFd(baton->out_fd, "wb")) || fwrite(data, 1, size, out) != size) baton->err = errno ? errno : EIO;
+    } else {
+        string::size_type dot = baton->out.find_last_of('.');
+        if (dot != string::npos) baton->out = baton->out.substr(0, dot);
+        baton->out += "." + baton->ext;
+        // A short write does not always set errno
+        errno = 0;
+        if (!bkMakePath(baton->out) || !(out = fopen(baton->out.c_str(), "wb")) || fwrite(data, 1, size, out) != size) {
+            baton->err = errno ? errno : EIO;
+        }
+    }
+    if (out && fclose(out) && !baton->err) baton->err = errno;
+    baton->length = size;
+}
+
+// Raw pixels of the current frame in the requested layout and storage type, into the caller Buffer if given
+static MagickBooleanType exportMagickPixels(MagickBaton *baton, MagickWand *wand)
+{
+    size_t size = (size_t)baton->d.width * baton->d.height * strlen(baton->d.raw) * getMagickStorageSize(baton->d.storage);
+    unsigned char *data = baton->output_data;
+    if (data && baton->output_length < size) {
+        baton->err = ENOBUFS;
+        return MagickTrue;
+    }
+    if (!data) data = (unsigned char*)malloc(size);
+    if (!data) {
+        baton->err = ENOMEM;
+        return MagickTrue;
+    }
+    MagickBooleanType status = MagickExportImagePixels(wand, 0, 0, baton->d.width, baton->d.height, baton->d.raw, baton->d.storage, data);
+    baton->ext = "raw";
+    if (status && (baton->out.size() || baton->out_fd >= 0)) {
+        writeMagickFile(baton, data, size);
+    } else
+    if (status && data != baton->output_data) {
+        baton->image = data;
+        baton->image_malloc = true;
+        data = NULL;
+    }
+    if (data != baton->output_data) free(data);
+    baton->length = size;
+    return status;
+}
+
+// Per-format encoder settings, ImageMagick ignores options of delegates that are not available
+static void setMagickEncoder(MagickBaton *baton, MagickWand *wand)
+{
+    char val[32];
+    int n;
+    if (baton->ext == "jpg") {
+        n = getMagickProfileValue(baton, baton->d.progressive, 0, 1);
+        if (n >= 0) {
+            MagickSetInterlaceScheme(wand, n ? JPEGInterlace : NoInterlace);
+            MagickSetImageInterlaceScheme(wand, n ? JPEGInterlace : NoInterlace);
+        }
+        n = getMagickProfileValue(baton, baton->d.optimize, 0, 1);
+        if (n >= 0) MagickSetOption(wand, "jpeg:optimize-coding", n ? "true" : "false");
+        if (baton->d.sampling_h) {
+            double factors[2] = { (double)baton->d.sampling_h, (double)baton->d.sampling_v };
+            MagickSetSamplingFactors(wand, 2, factors);
+        }
+        const char *dct = baton->d.dct[0] ? baton->d.dct : baton->d.profile == MagickProfileFast ? "ifast" : NULL;
+        if (dct) MagickSetOption(wand, "jpeg:dct-method", dct);
+    } else
+    if (baton->ext == "png") {
+        if (baton->d.progressive >= 0) MagickSetInterlaceScheme(wand, baton->d.progressive ? PNGInterlace : NoInterlace);
+        n = getMagickProfileValue(baton, baton->d.png_level, 1, 9);
+        if (n >= 0) {
+            snprintf(val, sizeof(val), "%d", n);
+            MagickSetOption(wand, "png:compression-level", val);
+        }
+        if (baton->d.png_strategy >= 0) {
+            snprintf(val, sizeof(val), "%d", baton->d.png_strategy);
+            MagickSetOption(wand, "png:compression-strategy", val);
+        }
+        n = getMagickProfileValue(baton, baton->d.png_filter, -1, 5);
+        if (n >= 0) {
+            snprintf(val, sizeof(val), "%d", n);
+            MagickSetOption(wand, "png:compression-filter", val);
+        }
+    } else
+    if (baton->ext == "webp") {
+        n = getMagickProfileValue(baton, baton->d.webp_method, 1, 6);
+        if (n >= 0) {
+            snprintf(val, sizeof(val), "%d", n);
+            MagickSetOption(wand, "webp:method", val);
+        }
+        if (baton->d.lossless >= 0) MagickSetOption(wand, "webp:lossless", baton->d.lossless ? "true" : "false");
+        if (baton->d.alpha_quality >= 0) {
+            snprintf(val, sizeof(val), "%d", baton->d.alpha_quality);
+            MagickSetOption(wand, "webp:alpha-quality", val);
+        }
+    } else
+    if (baton->ext == "heic" || baton->ext == "avif") {
+        n = getMagickProfileValue(baton, baton->d.speed, 8, 2);
+        if (n >= 0) {
+            snprintf(val, sizeof(val), "%d", n);
+            MagickSetOption(wand, "heic:speed", val);
+        }
+    }
+}
+
+// Save the image into the output file or a blob
+static MagickBooleanType writeMagickImage(MagickBaton *baton, MagickWand *wand, int frames)
+{
+    MagickBooleanType status;
+    char *str;
+
+    // Output info about the new or unmodified image
+    baton->d.width = MagickGetImageWidth(wand);
+    baton->d.height = MagickGetImageHeight(wand);
+    str = MagickGetImageFormat(wand);
+    if (str) {
+        baton->ext = str;
+        free(str);
+    }
+    // File extension, lowercase and 3 letters only
+    std::transform(baton->ext.begin(), baton->ext.end(), baton->ext.begin(), ::tolower);
+    if (baton->ext == "jpeg") baton->ext = "jpg";
+
+    if (baton->d.raw[0]) return exportMagickPixels(baton, wand);
+    setMagickEncoder(baton, wand);
+
+    if (baton->out_fd >= 0) {
+        // Encoded straight into the descriptor, the size is known only for regular files
+        FILE *fp = bkOpenFd(baton->out_fd, "wb");
+        if (!fp) {
+            baton->err = errno;
+            return MagickTrue;
+        }
+        if (frames > 1) {
+            status = MagickWriteImagesFile(wand, fp);
+        } else {
+            status = MagickWriteImageFile(wand, fp);
+        }
+        off_t size = ftello(fp);
+        if (size > 0) baton->length = size;
+        if (fclose(fp) && status) baton->err = errno;
+        if (status == MagickFalse) return status;
+    } else
+    if (baton->out.size()) {
+        // Make sure all subdirs exist
+        if (bkMakePath(baton->out)) {
+            string::size_type dot = baton->out.find_last_of('.');
+            if (dot != string::npos) baton->out = baton->out.substr(0, dot);
+            baton->out += "." + baton->ext;
+
+            if (frames > 1) {
+                status = MagickWriteImages(wand, baton->out.c_str(), MagickTrue);
+            } else {
+                status = MagickWriteImage(wand, baton->out.c_str());
+            }
+            if (status == MagickFalse) return status;
+            struct stat st;
+            if (!stat(baton->out.c_str(), &st)) baton->length = st.st_size;
+        } else {
+            baton->err = errno;
+        }
+    } else {
+        if (frames > 1) {
+            baton->image = MagickGetImagesBlob(wand, &baton->length);
+        } else {
+            baton->image = MagickGetImageBlob(wand, &baton->length);
+        }
+        if (!baton->image) return MagickFalse;
+    }
+    return MagickTrue;
+}
+
+// Free callback for Buffers that own the ImageMagick blob
+static void freeMagickBuffer(char *data, void *hint)
+{
+    MagickRelinquishMemory(data);
+}
+
+static void freeBuffer(char *data, void *hint)
+{
+    free(data);
+}
+
+static void releaseMagickImage(MagickImageRef *ref)
+{
+    if (--ref->refs) return;
+    if (ref->malloc) free(ref->data); else MagickRelinquishMemory(ref->data);
+    delete ref;
+}
+
+// Free callback for Buffers that share the image with the cache
+static void freeSharedBuffer(char *data, void *hint)
+{
+    releaseMagickImage((MagickImageRef *)hint);
+}
+
+static void freeMagickImage(MagickBaton *baton)
+{
+    if (!baton->image) return;
+    if (baton->image_ref) releaseMagickImage(baton->image_ref); else
+    if (baton->image_malloc) free(baton->image); else MagickRelinquishMemory(baton->image);
+    baton->image = NULL;
+    baton->image_ref = NULL;
+}
+
+static const uint32_t bkSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t bkRotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static void bkSha256Block(uint32_t *h, const unsigned char *p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = uint32_t(p[i*4]) << 24 | uint32_t(p[i*4+1]) << 16 | uint32_t(p[i*4+2]) << 8 | p[i*4+3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = bkRotr(w[i-15], 7) ^ bkRotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = bkRotr(w[i-2], 17) ^ bkRotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (bkRotr(e, 6) ^ bkRotr(e, 11) ^ bkRotr(e, 25)) + ((e & f) ^ (~e & g)) + bkSha256K[i] + w[i];
+        uint32_t t2 = (bkRotr(a, 2) ^ bkRotr(a, 13) ^ bkRotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+// SHA-256 digest as 32 raw bytes, used for cache keys and disk cache file names
+static string bkSha256(const void *data, size_t len)
+{
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    const unsigned char *p = (const unsigned char*)data;
+    size_t n = len;
+    for (; n >= 64; n -= 64, p += 64) bkSha256Block(h, p);
+
+    unsigned char tail[128];
+    size_t size = n < 56 ? 64 : 128;
+    memset(tail, 0, sizeof(tail));
+    if (n) memcpy(tail, p, n);
+    tail[n] = 0x80;
+    for (int i = 0; i < 8; i++) tail[size - 1 - i] = (uint64_t(len) * 8) >> (i * 8);
+    bkSha256Block(h, tail);
+    if (size == 128) bkSha256Block(h, tail + 64);
+
+    string digest(32, 0);
+    for (int i = 0; i < 32; i++) digest[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    return digest;
+}
+
+static string bkToHex(const string &data)
+{
+    static const char *digits = "0123456789abcdef";
+    string hex;
+    for (uint i = 0; i < data.size(); i++) {
+        hex += digits[(unsigned char)data[i] >> 4];
+        hex += digits[(unsigned char)data[i] & 15];
+    }
+    return hex;
+}
+
+// Raw bytes of a number, for cache keys
+template <typename T>
+static void bkKeyAppend(string &key, const T &val)
+{
+    key.append((const char*)&val, sizeof(val));
+}
+
+// Length and bytes of a string so consecutive strings cannot run into each other
+static void bkKeyAppend(string &key, const string &val)
+{
+    bkKeyAppend(key, val.size());
+    key += val;
+}
+
+// Every option field by itself, the struct as a whole has padding bytes which are not always copied
+static void getMagickOptionsKey(string &key, MagickBaton *baton)
+{
+    bkKeyAppend(key, baton->d.quality);
+    bkKeyAppend(key, baton->d.width);
+    bkKeyAppend(key, baton->d.height);
+    bkKeyAppend(key, baton->d.frame);
+    bkKeyAppend(key, baton->d.blur_radius);
+    bkKeyAppend(key, baton->d.blur_sigma);
+    bkKeyAppend(key, baton->d.sharpen_radius);
+    bkKeyAppend(key, baton->d.sharpen_sigma);
+    bkKeyAppend(key, baton->d.brightness);
+    bkKeyAppend(key, baton->d.contrast);
+    bkKeyAppend(key, baton->d.crop_x);
+    bkKeyAppend(key, baton->d.crop_y);
+    bkKeyAppend(key, baton->d.crop_width);
+    bkKeyAppend(key, baton->d.crop_height);
+    bkKeyAppend(key, baton->d.posterize);
+    bkKeyAppend(key, baton->d.quantize);
+    bkKeyAppend(key, baton->d.tree_depth);
+    bkKeyAppend(key, baton->d.normalize);
+    bkKeyAppend(key, baton->d.flip);
+    bkKeyAppend(key, baton->d.flop);
+    bkKeyAppend(key, baton->d.strip);
+    bkKeyAppend(key, baton->d.colorspace);
+    bkKeyAppend(key, baton->d.dither);
+    bkKeyAppend(key, baton->d.gravity);
+    bkKeyAppend(key, baton->d.rotate);
+    bkKeyAppend(key, baton->d.opacity);
+    bkKeyAppend(key, baton->d.orientation);
+    bkKeyAppend(key, baton->d.no_animation);
+    bkKeyAppend(key, baton->d.shrink);
+    bkKeyAppend(key, baton->d.cascade);
+    bkKeyAppend(key, baton->d.strict);
+    bkKeyAppend(key, baton->d.reorder);
+    bkKeyAppend(key, baton->d.max_frames);
+    bkKeyAppend(key, baton->d.max_frame_pixels);
+    bkKeyAppend(key, string(baton->d.raw));
+    bkKeyAppend(key, baton->d.storage);
+    bkKeyAppend(key, baton->d.profile);
+    bkKeyAppend(key, baton->d.progressive);
+    bkKeyAppend(key, baton->d.optimize);
+    bkKeyAppend(key, baton->d.sampling_h);
+    bkKeyAppend(key, baton->d.sampling_v);
+    bkKeyAppend(key, string(baton->d.dct));
+    bkKeyAppend(key, baton->d.png_level);
+    bkKeyAppend(key, baton->d.png_strategy);
+    bkKeyAppend(key, baton->d.png_filter);
+    bkKeyAppend(key, baton->d.webp_method);
+    bkKeyAppend(key, baton->d.lossless);
+    bkKeyAppend(key, baton->d.alpha_quality);
+    bkKeyAppend(key, baton->d.speed);
+    bkKeyAppend(key, baton->d.dhash);
+    bkKeyAppend(key, baton->d.colors);
+    bkKeyAppend(key, baton->d.blurhash_x);
+    bkKeyAppend(key, baton->d.blurhash_y);
+    bkKeyAppend(key, baton->filter);
+    bkKeyAppend(key, baton->format);
+    bkKeyAppend(key, baton->bgcolor);
+    bkKeyAppend(key, baton->engine);
+}
+
+// Digest of the source bytes or the file identity plus all parsed options and the quantum depth of this build,
+// runs on a pool thread, the whole key is kept with the result and compared on every hit, empty if the file is missing
+static string getMagickCacheKey(MagickBaton *baton)
+{
+    string key;
+    size_t depth = 0;
+    MagickGetQuantumDepth(&depth);
+    bkKeyAppend(key, depth);
+    if (baton->blob) {
+        key += 'b';
+        key += bkSha256(baton->blob, baton->blob_length);
+    } else {
+        struct stat st;
+        if (stat(baton->path.c_str(), &st)) return "";
+        key += 'f';
+        bkKeyAppend(key, baton->path);
+        bkKeyAppend(key, st.st_dev);
+        bkKeyAppend(key, st.st_ino);
+        bkKeyAppend(key, st.st_size);
+        bkKeyAppend(key, st.st_mtime);
+        bkKeyAppend(key, st.st_ctime);
+    }
+    getMagickOptionsKey(key, baton);
+    if (baton->in.width) {
+        bkKeyAppend(key, baton->in.layout);
+        bkKeyAppend(key, baton->in.width);
+        bkKeyAppend(key, baton->in.height);
+        bkKeyAppend(key, baton->in.storage);
+    }
+    return key;
+}
+
+// Copy the result of a finished request with the same options, the image is shared by reference count, not copied
+static void copyMagickResult(MagickBaton *baton, MagickBaton *from)
+{
+    baton->d = from->d;
+    baton->o = from->o;
+    baton->ext = from->ext;
+    baton->err = from->err;
+    baton->severity = from->severity;
+    baton->a = from->a;
+    if (from->exception) baton->exception = AcquireString(from->exception);
+    if (from->image) {
+        if (!from->image_ref) from->image_ref = new MagickImageRef(from->image, from->image_malloc);
+        from->image_ref->refs++;
+        baton->image = from->image;
+        baton->image_ref = from->image_ref;
+        baton->length = from->length;
+    }
+}
+
+// Entries are only changed under the cache lock
+static void evictMagickCache(MagickCache &cache)
+{
+    while (cache.size > cache.max_size && cache.lru.size()) {
+        MagickBaton *last = cache.lru.back();
+        cache.lru.pop_back();
+        cache.items.erase(last->cache_key);
+        cache.size -= last->length;
+        cache.evictions++;
+        freeMagickImage(last);
+        delete last;
+    }
+}
+
+static void putMagickCache(MagickBaton *baton, MagickCache &cache)
+{
+    if (!baton->image || baton->length > cache.max_size) return;
+    MagickBaton *entry = new MagickBaton;
+    copyMagickResult(entry, baton);
+    entry->cache_key = baton->cache_key;
+    cache.lru.push_front(entry);
+    cache.items[entry->cache_key] = cache.lru.begin();
+    cache.size += entry->length;
+    evictMagickCache(cache);
+}
+
+static void doResizeImage(WandWork *req);
+static void afterResizeImage(WandWork *req, int status);
+
+// Look up the request under the cache lock: 1 if served from memory, 2 if the same request is already running,
+// otherwise 0 and the request is registered as running and will store its result
+static int lookupMagickCache(MagickBaton *baton, MagickCache &cache)
+{
+    unordered_map<string, list<MagickBaton*>::iterator>::iterator it = cache.items.find(baton->cache_key);
+    if (it != cache.items.end()) {
+        cache.hits++;
+        cache.lru.splice(cache.lru.begin(), cache.lru, it->second);
+        copyMagickResult(baton, *it->second);
+        baton->cache_key.clear();
+        baton->complete = true;
+        return 1;
+    }
+    if (cache.pending.count(baton->cache_key)) {
+        cache.coalesced++;
+        return 2;
+    }
+    cache.misses++;
+    cache.pending[baton->cache_key];
+    // Analysis results are not kept in the disk cache
+    if (cache.dir.size() && !isMagickAnalyze(baton)) {
+        baton->cache_file = cache.dir + "/" + bkToHex(bkSha256(baton->cache_key.data(), baton->cache_key.size()));
+    }
+    return 0;
+}
+
+// Key and lookup at the start of the job on the pool thread, large buffers take milliseconds to hash, returns true
+// if the job does not need to run: the result is copied from memory or the same request is running, then the job
+// waits for it once completed, see waitMagickCache
+static bool findMagickCache(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickCache &cache = req->env->cache;
+    baton->cache_lookup = false;
+    baton->cache_key = getMagickCacheKey(baton);
+    if (baton->cache_key.empty()) return false;
+    uv_mutex_lock(&cache.lock);
+    int found = lookupMagickCache(baton, cache);
+    uv_mutex_unlock(&cache.lock);
+    baton->cache_running = found == 2;
+    return found > 0;
+}
+
+// The job found the same request running, it waits for its result unless that request has finished meanwhile,
+// then it is served from memory or runs itself, returns false if the result is ready
+static bool waitMagickCache(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickCache &cache = env->cache;
+    uv_mutex_lock(&cache.lock);
+    unordered_map<string, vector<WandWork*> >::iterator p = cache.pending.find(baton->cache_key);
+    int found = 2;
+    if (p != cache.pending.end()) p->second.push_back(req); else found = lookupMagickCache(baton, cache);
+    uv_mutex_unlock(&cache.lock);
+    baton->cache_wait = found == 2;
+    if (found == 1) return false;
+    // Still cancellable by its id
+    if (found == 2) env->jobs[req->id] = req; else bkQueueWork(req, doResizeImage, afterResizeImage);
+    return true;
+}
+
+// Disk cache check by a pool job, removes files not used for longer than the age, then the least recently used
+// until the total size fits
+struct MagickCacheTrim : public WandWork {
+    string dir;
+    size_t max_size;
+    int max_age;
+};
+
+struct MagickCacheFile {
+    time_t mtime;
+    size_t size;
+    string path;
+};
+
+static bool bkOlderFile(const MagickCacheFile &a, const MagickCacheFile &b)
+{
+    return a.mtime < b.mtime;
+}
+
+static void doTrimMagickCache(WandWork *work)
+{
+    MagickCacheTrim *req = (MagickCacheTrim *)work;
+    DIR *dir = opendir(req->dir.c_str());
+    if (!dir) return;
+
+    vector<MagickCacheFile> files;
+    size_t size = 0;
+    time_t now = time(NULL);
+    struct dirent *ent;
+    struct stat st;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        MagickCacheFile file;
+        file.path = req->dir + "/" + ent->d_name;
+        if (stat(file.path.c_str(), &st) || !S_ISREG(st.st_mode)) continue;
+        // Temporary files left by a crashed writer expire the same way
+        if (req->max_age > 0 && now - st.st_mtime > req->max_age) {
+            unlink(file.path.c_str());
+            continue;
+        }
+        file.mtime = st.st_mtime;
+        file.size = st.st_size;
+        size += file.size;
+        files.push_back(file);
+    }
+    closedir(dir);
+    if (!req->max_size || size <= req->max_size) return;
+
+    std::sort(files.begin(), files.end(), bkOlderFile);
+    for (uint i = 0; i < files.size() && size > req->max_size; i++) {
+        if (!unlink(files[i].path.c_str())) size -= files[i].size;
+    }
+}
+
+static void afterTrimMagickCache(WandWork *req, int status)
+{
+    env->cache.disk_trimming = false;
+    delete (MagickCacheTrim *)req;
+}
+
+// Start a disk cache check once new files reach 1/16 of the size limit or 1/16 of the age limit has passed,
+// only one check runs at a time
+static void checkMagickCacheDir(size_t written, bool force)
+{
+    MagickCache &cache = env->cache;
+    cache.disk_written += written;
+    if (cache.dir.empty() || cache.disk_trimming || env->closing || (!cache.disk_max_size && cache.disk_max_age <= 0)) return;
+    if (!force && !(cache.disk_max_size && cache.disk_written > cache.disk_max_size / 16) &&
+        !(cache.disk_max_age > 0 && uv_now(env->loop) - cache.disk_trimmed > cache.disk_max_age * 1000ULL / 16)) return;
+
+    MagickCacheTrim *req = new MagickCacheTrim;
+    req->dir = cache.dir;
+    req->max_size = cache.disk_max_size;
+    req->max_age = cache.disk_max_age;
+    cache.disk_written = 0;
+    cache.disk_trimmed = uv_now(env->loop);
+    cache.disk_trimming = true;
+    bkQueueWork(req, doTrimMagickCache, afterTrimMagickCache);
+}
+
+// Store the result and complete all requests waiting for it
+static void finishMagickCache(WandWork *req, int status)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickCache &cache = env->cache;
+
+    vector<WandWork*> waiting;
+    uv_mutex_lock(&cache.lock);
+    unordered_map<string, vector<WandWork*> >::iterator p = cache.pending.find(baton->cache_key);
+    if (p != cache.pending.end()) {
+        // Other requests still need the result, the first one runs the job instead unless all jobs are being cancelled
+        if ((status == UV_ECANCELED || status == UV_ETIMEDOUT) && p->second.size() && !env->closing) {
+            WandWork *next = p->second.front();
+            p->second.erase(p->second.begin());
+            uv_mutex_unlock(&cache.lock);
+            env->jobs.erase(next->id);
+            ((MagickBaton *)next->data)->cache_wait = false;
+            ((MagickBaton *)next->data)->cache_file = baton->cache_file;
+            bkQueueWork(next, req->work_cb, next->after_cb);
+            baton->cache_key.clear();
+            return;
+        }
+        waiting.swap(p->second);
+    }
+    // Stored before the request stops running so new jobs with the same key find one or the other
+    if (!status && !baton->err && !baton->exception) putMagickCache(baton, cache);
+    if (p != cache.pending.end()) cache.pending.erase(p);
+    uv_mutex_unlock(&cache.lock);
+    // A new disk cache file has been written, served files clear the name
+    if (!status && baton->image && baton->cache_file.size()) checkMagickCacheDir(baton->length, false);
+    baton->cache_key.clear();
+
+    for (uint i = 0; i < waiting.size(); i++) {
+        MagickBaton *w = (MagickBaton *)waiting[i]->data;
+        env->jobs.erase(waiting[i]->id);
+        w->cache_wait = false;
+        w->cache_key.clear();
+        if (!status) copyMagickResult(w, baton);
+        waiting[i]->after_cb(waiting[i], status);
+    }
+}
+
+// Complete a request waiting for the same request run by another job, returns false if it is not waiting
+static bool cancelMagickCache(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    if (req->work_cb != doResizeImage || !baton->cache_wait) return false;
+    MagickCache &cache = env->cache;
+    uv_mutex_lock(&cache.lock);
+    unordered_map<string, vector<WandWork*> >::iterator p = cache.pending.find(baton->cache_key);
+    vector<WandWork*>::iterator w;
+    bool found = p != cache.pending.end() && (w = std::find(p->second.begin(), p->second.end(), req)) != p->second.end();
+    if (found) p->second.erase(w);
+    uv_mutex_unlock(&cache.lock);
+    if (!found) return false;
+    baton->cache_wait = false;
+    env->jobs.erase(req->id);
+    baton->cache_key.clear();
+    bkCompleteWork(req, req->after_cb, UV_ECANCELED);
+    return true;
+}
+
+// Disk cache file: the key length and the key, a header line with the result properties, then the image,
+// a file with a different key is a miss
+static bool readMagickCacheFile(MagickBaton *baton)
+{
+    FILE *fp = fopen(baton->cache_file.c_str(), "rb");
+    if (!fp) return false;
+    char ext[16], oext[16];
+    size_t size = 0;
+    long pos;
+    bool ok = fscanf(fp, "%zu", &size) == 1 && fgetc(fp) == '\n' && size == baton->cache_key.size();
+    if (ok) {
+        string key(size, 0);
+        ok = fread(&key[0], 1, size, fp) == size && key == baton->cache_key;
+    }
+    if (ok) {
+        ok = fscanf(fp, "%d %d %d %d %d %d %15s %15s", &baton->d.width, &baton->d.height, &baton->d.orientation,
+                    &baton->o.width, &baton->o.height, &baton->o.orientation, ext, oext) == 8 && fgetc(fp) == '\n';
+    }
+    if (ok) {
+        pos = ftell(fp);
+        fseek(fp, 0, SEEK_END);
+        baton->length = ftell(fp) - pos;
+        fseek(fp, pos, SEEK_SET);
+        baton->image = (unsigned char*)malloc(baton->length);
+        baton->image_malloc = true;
+        ok = baton->image && fread(baton->image, 1, baton->length, fp) == baton->length;
+        if (!ok) freeMagickImage(baton);
+    }
+    fclose(fp);
+    if (!ok) return false;
+    // The modification time is the last use for the disk cache limits
+    utimes(baton->cache_file.c_str(), NULL);
+    baton->ext = strcmp(ext, "-") ? ext : "";
+    baton->o.ext = strcmp(oext, "-") ? oext : "";
+    baton->cache_file.clear();
+    baton->cache_hit = true;
+    return true;
+}
+
+static void writeMagickCacheFile(MagickBaton *baton)
+{
+    if (!baton->image || baton->err || baton->exception) return;
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), ".%lu", (unsigned long)uv_thread_self());
+    string path = baton->cache_file + tmp;
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (!fp) return;
+    bool ok = fprintf(fp, "%zu\n", baton->cache_key.size()) > 0 &&
+              fwrite(baton->cache_key.data(), 1, baton->cache_key.size(), fp) == baton->cache_key.size() &&
+              fprintf(fp, "%d %d %d %d %d %d %s %s\n", baton->d.width, baton->d.height, baton->d.orientation,
+                      baton->o.width, baton->o.height, baton->o.orientation,
+                      baton->ext.size() ? baton->ext.c_str() : "-", baton->o.ext.size() ? baton->o.ext.c_str() : "-") > 0 &&
+              fwrite(baton->image, 1, baton->length, fp) == baton->length;
+    if (fclose(fp) || !ok || rename(path.c_str(), baton->cache_file.c_str())) unlink(path.c_str());
+}
+
+// Returns true if the image is only resized and encoded so it can be produced from a larger rendition
+static bool isMagickResizeOnly(MagickBaton *baton)
+{
+    return !baton->d.rotate && !baton->bgcolor.size() && !(baton->d.crop_width && baton->d.crop_height) &&
+           baton->d.colorspace == UndefinedColorspace && !baton->d.opacity && !baton->d.normalize &&
+           !baton->d.posterize && !baton->d.quantize && !baton->d.flip && !baton->d.flop &&
+           !baton->d.blur_radius && !baton->d.blur_sigma && !baton->d.sharpen_radius && !baton->d.sharpen_sigma &&
+           !baton->d.brightness && !baton->d.contrast;
+}
+
+static bool isMagickLarger(const MagickBaton *a, const MagickBaton *b)
+{
+    return a->d.width * a->d.height > b->d.width * b->d.height;
+}
+
+#ifdef USE_JPEG
+// Fast path for JPEG to JPEG resizing with libjpeg-turbo, decodes with scaled IDCT directly into 8-bit rows,
+// resamples with a separable fixed point filter and encodes without going through the pixel cache
+struct JpegError {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+};
+
+// Resampling taps in 14-bit fixed point for every output pixel
+struct JpegFilter {
+    int taps;
+    vector<int> start;
+    vector<int> count;
+    vector<short> weights;
+};
+
+static void bkJpegErrorExit(j_common_ptr cinfo)
+{
+    longjmp(((JpegError*)cinfo->err)->jmp, 1);
+}
+
+static void bkJpegOutputMessage(j_common_ptr cinfo)
+{
+}
+
+// Encoder output in a buffer owned by the job, unlike jpeg_mem_dest it can be freed after an error in the middle
+// of encoding, it lives in memory so the error path sees the last grown buffer
+struct JpegDest {
+    struct jpeg_destination_mgr pub;
+    unsigned char *data;
+    size_t size;
+};
+
+static void bkJpegInitDest(j_compress_ptr cinfo)
+{
+    JpegDest *dest = (JpegDest*)cinfo->dest;
+    dest->pub.next_output_byte = dest->data;
+    dest->pub.free_in_buffer = dest->size;
+}
+
+// The buffer is doubled when full, the encoder fails through the error handler if it cannot grow
+static boolean bkJpegEmptyDest(j_compress_ptr cinfo)
+{
+    JpegDest *dest = (JpegDest*)cinfo->dest;
+    unsigned char *data = (unsigned char*)realloc(dest->data, dest->size * 2);
+    if (!data) cinfo->err->error_exit((j_common_ptr)cinfo);
+    dest->data = data;
+    dest->pub.next_output_byte = data + dest->size;
+    dest->pub.free_in_buffer = dest->size;
+    dest->size *= 2;
+    return TRUE;
+}
+
+// Size becomes the length of the encoded image
+static void bkJpegTermDest(j_compress_ptr cinfo)
+{
+    JpegDest *dest = (JpegDest*)cinfo->dest;
+    dest->size -= dest->pub.free_in_buffer;
+}
+
+static unsigned bkJpegGet16(const JOCTET *p, bool le)
+{
+    return le ? p[0] | p[1] << 8 : p[0] << 8 | p[1];
+}
+
+static unsigned bkJpegGet32(const JOCTET *p, bool le)
+{
+    return le ? bkJpegGet16(p, le) | bkJpegGet16(p + 2, le) << 16 : bkJpegGet16(p, le) << 16 | bkJpegGet16(p + 2, le);
+}
+
+// Orientation tag from the EXIF APP1 marker
+static int bkJpegOrientation(jpeg_saved_marker_ptr marker)
+{
+    for (; marker; marker = marker->next) {
+        if (marker->marker != JPEG_APP0 + 1 || marker->data_length < 14 || memcmp(marker->data, "Exif\0\0", 6)) continue;
+        const JOCTET *tiff = marker->data + 6;
+        unsigned len = marker->data_length - 6;
+        bool le = tiff[0] == 'I';
+        unsigned ifd = bkJpegGet32(tiff + 4, le);
+        if (ifd + 2 > len) return 0;
+        unsigned n = bkJpegGet16(tiff + ifd, le);
+        for (unsigned i = 0; i < n && ifd + 2 + i * 12 + 12 <= len; i++) {
+            const JOCTET *entry = tiff + ifd + 2 + i * 12;
+            if (bkJpegGet16(entry, le) == 0x0112) return bkJpegGet16(entry + 8, le);
+        }
+    }
+    return 0;
+}
+
+static double bkJpegKernel(FilterType filter, double x)
+{
+    x = fabs(x);
+    if (filter == CatromFilter) {
+        if (x < 1) return 1.5 * x * x * x - 2.5 * x * x + 1;
+        if (x < 2) return -0.5 * x * x * x + 2.5 * x * x - 4 * x + 2;
+        return 0;
+    }
+    // Lanczos with 3 lobes
+    if (x < 1e-8) return 1;
+    if (x >= 3) return 0;
+    return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+}
+
+static void bkJpegFilterInit(JpegFilter &f, FilterType filter, int in, int out)
+{
+    double scale = (in * 1.0)/out;
+    double fscale = max(scale, 1.0);
+    double support = (filter == CatromFilter ? 2 : 3) * fscale;
+    vector<double> w;
+
+    // Rounded up to 8 zero weights for the SIMD rows
+    f.taps = ((int)ceil(support) * 2 + 1 + 7) & ~7;
+    f.start.resize(out);
+    f.count.resize(out);
+    f.weights.assign(out * f.taps, 0);
+    for (int i = 0; i < out; i++) {
+        double center = (i + 0.5) * scale;
+        int start = max((int)(center - support + 0.5), 0);
+        int stop = min((int)(center + support + 0.5), in);
+        int n = min(stop - start, f.taps);
+        double sum = 0;
+        w.resize(n);
+        for (int j = 0; j < n; j++) {
+            w[j] = bkJpegKernel(filter, (start + j + 0.5 - center) / fscale);
+            sum += w[j];
+        }
+        // Weights must add up exactly to 1.0, the rounding error goes to the largest tap
+        short *fw = &f.weights[i * f.taps];
+        int total = 0, big = 0;
+        for (int j = 0; j < n; j++) {
+            fw[j] = (short)lround(w[j] / sum * 16384);
+            total += fw[j];
+            if (fw[j] > fw[big]) big = j;
+        }
+        fw[big] += 16384 - total;
+        f.start[i] = start;
+        f.count[i] = n;
+    }
+}
+
+static inline JSAMPLE bkJpegClamp(int v)
+{
+    v >>= 14;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+template<int ch>
+static void bkJpegResizeRow(const JSAMPLE *in, JSAMPLE *out, const JpegFilter &f, int width)
+{
+    for (int x = 0; x < width; x++) {
+        const short *w = &f.weights[x * f.taps];
+        const JSAMPLE *p = in + f.start[x] * ch;
+        int sum[ch];
+        for (int c = 0; c < ch; c++) sum[c] = 1 << 13;
+        for (int k = 0; k < f.count[x]; k++, p += ch) {
+            for (int c = 0; c < ch; c++) sum[c] += p[c] * w[k];
+        }
+        for (int c = 0; c < ch; c++) *out++ = bkJpegClamp(sum[c]);
+    }
+}
+
+#ifdef __SSE2__
+// Input rows must have JPEG_ROW_PAD readable bytes after the last pixel, taps past the count have 0 weights
+#define JPEG_ROW_PAD 16
+
+// Two taps of all 3 channels per multiply-add: pixels k and k+1 are interleaved as a0 b0 a1 b1 a2 b2 with
+// weights wk wk1 repeated, the last 2 lanes hold bytes of pixel k+2 and get 0 weights
+template<>
+void bkJpegResizeRow<3>(const JSAMPLE *in, JSAMPLE *out, const JpegFilter &f, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int x = 0; x < width; x++, out += 3) {
+        const short *w = &f.weights[x * f.taps];
+        const JSAMPLE *p = in + f.start[x] * 3;
+        int n = f.count[x];
+        __m128i sum = _mm_set_epi32(0, 1 << 13, 1 << 13, 1 << 13);
+        for (int k = 0; k < n; k += 2, p += 6) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p), zero);
+            __m128i ab = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 6));
+            __m128i wv = _mm_set_epi16(0, 0, w[k + 1], w[k], w[k + 1], w[k], w[k + 1], w[k]);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(ab, wv));
+        }
+        sum = _mm_packus_epi16(_mm_packs_epi32(_mm_srai_epi32(sum, 14), zero), zero);
+        int v = _mm_cvtsi128_si32(sum);
+        memcpy(out, &v, 3);
+    }
+}
+
+// Gray rows have contiguous taps, 8 per multiply-add
+template<>
+void bkJpegResizeRow<1>(const JSAMPLE *in, JSAMPLE *out, const JpegFilter &f, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int x = 0; x < width; x++) {
+        const short *w = &f.weights[x * f.taps];
+        const JSAMPLE *p = in + f.start[x];
+        int n = f.count[x];
+        __m128i sum = _mm_set_epi32(0, 0, 0, 1 << 13);
+        for (int k = 0; k < n; k += 8) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p + k)), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(v, _mm_loadu_si128((const __m128i*)(w + k))));
+        }
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+        *out++ = bkJpegClamp(_mm_cvtsi128_si32(sum));
+    }
+}
+#else
+#define JPEG_ROW_PAD 0
+#endif
+
+static void bkJpegResizeColumn(const JSAMPLE *in, JSAMPLE *out, int *acc, const JpegFilter &f, int y, int stride)
+{
+    const short *w = &f.weights[y * f.taps];
+    const JSAMPLE *p = in + f.start[y] * stride;
+    for (int i = 0; i < stride; i++) acc[i] = 1 << 13;
+    for (int k = 0; k < f.count[y]; k++, p += stride) {
+        const int wk = w[k];
+        for (int i = 0; i < stride; i++) acc[i] += p[i] * wk;
+    }
+    for (int i = 0; i < stride; i++) out[i] = bkJpegClamp(acc[i]);
+}
+
+// Returns true if the options only resize and re-encode JPEG with explicit quality
+static bool isJpegEngine(MagickBaton *baton)
+{
+    if (baton->engine == "magick" || baton->d.quality <= 0 || baton->d.quality > 100) return false;
+    if (baton->in.width || baton->d.raw[0] || isMagickAnalyze(baton) || baton->fd >= 0) return false;
+    if (baton->filter != LanczosFilter && baton->filter != CatromFilter) return false;
+    if (!isMagickResizeOnly(baton) || baton->d.gravity != UndefinedGravity) return false;
+    const char *fmt = baton->format.c_str();
+    while (*fmt == '.') fmt++;
+    if (*fmt && strcasecmp(fmt, "jpg") && strcasecmp(fmt, "jpeg")) return false;
+    if (baton->blob) return baton->blob_length > 3 && baton->blob[0] == 0xFF && baton->blob[1] == 0xD8 && baton->blob[2] == 0xFF;
+    return true;
+}
+
+// Returns false if the image cannot be processed by the fast path and must go through ImageMagick
+static bool doJpegResize(MagickBaton *baton, WandWork *req)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    JpegError jerr;
+    JpegFilter fx, fy;
+    FILE *volatile fp = NULL;
+    JSAMPLE *volatile tmp = NULL;
+    JSAMPLE *volatile row = NULL;
+    int *volatile acc = NULL;
+    // Output buffer is owned by the destination, grown by the encoder and freed on errors
+    JpegDest dest;
+    dest.data = NULL;
+    dest.size = 0;
+    volatile bool compress = false;
+    uint64_t t = uv_hrtime(), rt;
+
+    if (!baton->blob) {
+        unsigned char magic[3];
+        fp = fopen(baton->path.c_str(), "rb");
+        if (!fp) return false;
+        if (fread(magic, 1, 3, fp) != 3 || magic[0] != 0xFF || magic[1] != 0xD8 || magic[2] != 0xFF) {
+            fclose(fp);
+            return false;
+        }
+        rewind(fp);
+    }
+
+    dinfo.err = cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = bkJpegErrorExit;
+    jerr.pub.output_message = bkJpegOutputMessage;
+    jpeg_create_decompress(&dinfo);
+
+    if (setjmp(jerr.jmp)) {
+        if (compress) jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        if (fp) fclose(fp);
+        free(tmp);
+        free(row);
+        free(acc);
+        free(dest.data);
+        baton->t[MagickStageResize] = 0;
+        return false;
+    }
+
+    if (fp) {
+        jpeg_stdio_src(&dinfo, fp);
+    } else {
+        jpeg_mem_src(&dinfo, (unsigned char*)baton->blob, baton->blob_length);
+    }
+    jpeg_save_markers(&dinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_save_markers(&dinfo, JPEG_APP0 + 2, 0xFFFF);
+    jpeg_read_header(&dinfo, TRUE);
+
+    // CMYK and YCCK are left to ImageMagick, YCbCr is resampled as is without color conversion
+    switch (dinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+    case JCS_YCbCr:
+    case JCS_RGB:
+        dinfo.out_color_space = dinfo.jpeg_color_space;
+        break;
+    default:
+        longjmp(jerr.jmp, 1);
+    }
+
+    int width = dinfo.image_width;
+    int height = dinfo.image_height;
+    setMagickTargetSize(baton, width, height);
+    if (baton->d.width <= 0 || baton->d.height <= 0) longjmp(jerr.jmp, 1);
+
+    // Smallest DCT scale that keeps the image not smaller than the target
+    dinfo.scale_denom = 8;
+    for (dinfo.scale_num = 1; dinfo.scale_num < 8; dinfo.scale_num++) {
+        if ((width * (int)dinfo.scale_num + 7) / 8 >= baton->d.width &&
+            (height * (int)dinfo.scale_num + 7) / 8 >= baton->d.height) break;
+    }
+    if (!baton->d.shrink) dinfo.scale_num = 8;
+    jpeg_start_decompress(&dinfo);
+
+    int ch = dinfo.output_components;
+    int inw = dinfo.output_width, inh = dinfo.output_height;
+    int outw = baton->d.width, outh = baton->d.height;
+    bkJpegFilterInit(fx, baton->filter, inw, outw);
+    bkJpegFilterInit(fy, baton->filter, inh, outh);
+
+    // Horizontal pass while decoding, only the narrow rows are kept
+    row = (JSAMPLE*)calloc(1, inw * ch + JPEG_ROW_PAD);
+    tmp = (JSAMPLE*)malloc((size_t)inh * outw * ch);
+    acc = (int*)malloc(outw * ch * sizeof(int));
+    if (!row || !tmp || !acc) longjmp(jerr.jmp, 1);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        JSAMPROW rows[1] = { row };
+        int y = dinfo.output_scanline;
+        if (!(y & 15) && bkWorkStatus(req)) longjmp(jerr.jmp, 1);
+        jpeg_read_scanlines(&dinfo, rows, 1);
+        rt = uv_hrtime();
+        if (ch == 3) {
+            bkJpegResizeRow<3>(row, tmp + (size_t)y * outw * ch, fx, outw);
+        } else {
+            bkJpegResizeRow<1>(row, tmp + (size_t)y * outw * ch, fx, outw);
+        }
+        baton->t[MagickStageResize] += bkLap(rt);
+    }
+    baton->t[MagickStageDecode] = bkLap(t) - baton->t[MagickStageResize];
+    uint64_t hresize = baton->t[MagickStageResize];
+
+    jpeg_create_compress(&cinfo);
+    compress = true;
+    dest.size = (size_t)outw * outh * ch / 2 + 65536;
+    for (jpeg_saved_marker_ptr m = dinfo.marker_list; m; m = m->next) dest.size += m->data_length + 4;
+    dest.data = (unsigned char*)malloc(dest.size);
+    if (!dest.data) longjmp(jerr.jmp, 1);
+    dest.pub.init_destination = bkJpegInitDest;
+    dest.pub.empty_output_buffer = bkJpegEmptyDest;
+    dest.pub.term_destination = bkJpegTermDest;
+    cinfo.dest = &dest.pub;
+    cinfo.image_width = outw;
+    cinfo.image_height = outh;
+    cinfo.input_components = ch;
+    cinfo.in_color_space = dinfo.out_color_space;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, baton->d.quality, TRUE);
+    // Same as ImageMagick, no chroma subsampling for high quality unless given
+    if (baton->d.sampling_h && ch == 3) {
+        cinfo.comp_info[0].h_samp_factor = baton->d.sampling_h;
+        cinfo.comp_info[0].v_samp_factor = baton->d.sampling_v;
+    } else
+    if (baton->d.quality >= 90 && ch == 3) cinfo.comp_info[0].h_samp_factor = cinfo.comp_info[0].v_samp_factor = 1;
+    if (getMagickProfileValue(baton, baton->d.optimize, 0, 1) > 0) cinfo.optimize_coding = TRUE;
+    if (getMagickProfileValue(baton, baton->d.progressive, 0, 1) > 0) jpeg_simple_progression(&cinfo);
+    const char *dct = baton->d.dct[0] ? baton->d.dct : baton->d.profile == MagickProfileFast ? "ifast" : "";
+    if (!strcmp(dct, "ifast")) cinfo.dct_method = JDCT_IFAST; else
+    if (!strcmp(dct, "float")) cinfo.dct_method = JDCT_FLOAT;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Keep EXIF and ICC profiles
+    baton->o.orientation = bkJpegOrientation(dinfo.marker_list);
+    if (!baton->d.strip) {
+        for (jpeg_saved_marker_ptr m = dinfo.marker_list; m; m = m->next) {
+            jpeg_write_marker(&cinfo, m->marker, m->data, m->data_length);
+        }
+    }
+
+    // Vertical pass straight into the encoder
+    row = (JSAMPLE*)realloc(row, outw * ch);
+    if (!row) longjmp(jerr.jmp, 1);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        JSAMPROW rows[1] = { row };
+        if (!(cinfo.next_scanline & 15) && bkWorkStatus(req)) longjmp(jerr.jmp, 1);
+        rt = uv_hrtime();
+        bkJpegResizeColumn(tmp, row, acc, fy, cinfo.next_scanline, outw * ch);
+        baton->t[MagickStageResize] += bkLap(rt);
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    baton->t[MagickStageEncode] = bkLap(t) - (baton->t[MagickStageResize] - hresize);
+    jpeg_destroy_compress(&cinfo);
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+    if (fp) fclose(fp);
+    free(tmp);
+    free(row);
+    free(acc);
+
+    baton->o.width = width;
+    baton->o.height = height;
+    baton->o.ext = baton->ext = "jpg";
+    baton->d.orientation = baton->o.orientation;
+
+    if (baton->out.size() || baton->out_fd >= 0) {
+        writeMagickFile(baton, dest.data, dest.size);
+        free(dest.data);
+    } else {
+        baton->image = dest.data;
+        baton->length = dest.size;
+        baton->image_malloc = true;
+    }
+    return true;
+}
+#endif
+
+// Input size for stats, the source blob is released after reading
+static void setMagickSourceSize(MagickBaton *baton)
+{
+    struct stat st;
+    if (baton->blob) baton->o.size = baton->blob_length; else
+    if (baton->fd >= 0) {
+        if (!fstat(baton->fd, &st) && S_ISREG(st.st_mode)) baton->o.size = st.st_size - max(baton->fd_offset, (off_t)0);
+    } else
+    if (!stat(baton->path.c_str(), &st)) baton->o.size = st.st_size;
+}
+
+// Pixel cache usage by all running jobs, the highest seen by this job is kept
+static void setMagickMemory(MagickBaton *baton)
+{
+    baton->memory = max(baton->memory, MagickGetResource(MemoryResource) + MagickGetResource(MapResource));
+}
+
+// Progress monitor for all images of a job, stops ImageMagick when the job is cancelled or expired
+static MagickBooleanType checkMagickProgress(const char *text, const MagickOffsetType offset, const MagickSizeType span, void *data)
+{
+    return bkWorkStatus((WandWork *)data) ? MagickFalse : MagickTrue;
+}
+
+static void doResizeImage(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    uint64_t t = uv_hrtime();
+    baton->t[MagickStageQueue] = t - baton->start;
+    if (baton->cache_lookup && findMagickCache(req)) return;
+    setMagickSourceSize(baton);
+    if (baton->cache_file.size() && readMagickCacheFile(baton)) {
+        baton->t[MagickStageDecode] = bkLap(t);
+        baton->complete = true;
+        return;
+    }
+#ifdef USE_JPEG
+    if (isJpegEngine(baton) && doJpegResize(baton, req)) {
+        if (baton->cache_file.size()) writeMagickCacheFile(baton);
+        baton->complete = !baton->err && !baton->exception;
+        return;
+    }
+#endif
+    if (bkWorkStatus(req)) return;
+    MagickWand *wand = NewMagickWand();
+    int frames = 0;
+
+    MagickSetProgressMonitor(wand, checkMagickProgress, req);
+    MagickBooleanType status = readMagickImage(baton, wand, frames);
+    baton->t[MagickStageDecode] = bkLap(t);
+    // Stop between stages if the result is not needed anymore
+    if (status && bkWorkStatus(req)) status = MagickFalse;
+    if (status) {
+        setMagickMemory(baton);
+        status = transformMagickImage(req, baton, wand, frames);
+        if (status) analyzeMagickImage(baton, wand, frames);
+        baton->t[MagickStageTransform] = bkLap(t) - baton->t[MagickStageResize];
+    }
+    if (status && bkWorkStatus(req)) status = MagickFalse;
+    if (status) {
+        setMagickMemory(baton);
+        status = writeMagickImage(baton, wand, frames);
+        baton->t[MagickStageEncode] = bkLap(t);
+    }
+    if (!status && !baton->exception) baton->exception = MagickGetException(wand, &baton->severity);
+    DestroyMagickWand(wand);
+    if (baton->cache_file.size()) writeMagickCacheFile(baton);
+    baton->complete = status && !baton->err;
+}
+
+// Pixels of the previous rendition in a new wand, encoder options, quality and interlace of that rendition are not
+// kept, the image properties are reset to the ones of the source
+static MagickWand *cloneMagickCascade(WandWork *req, MagickWand *wand, MagickWand *prev)
+{
+    MagickWand *rwand = NewMagickWand();
+    MagickSetProgressMonitor(rwand, checkMagickProgress, req);
+    MagickAddImage(rwand, prev);
+    MagickSetImageCompressionQuality(rwand, MagickGetImageCompressionQuality(wand));
+    MagickSetImageInterlaceScheme(rwand, MagickGetImageInterlaceScheme(wand));
+    return rwand;
+}
+
+// Decode the source once and produce all renditions from clones, from the largest to the smallest,
+// plain resizes start from the previous larger result instead of the full source
+static void doResizeImages(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickWand *wand = NewMagickWand();
+    uint64_t t = uv_hrtime();
+    int frames = 0;
+
+    baton->t[MagickStageQueue] = t - baton->start;
+    setMagickSourceSize(baton);
+    MagickSetProgressMonitor(wand, checkMagickProgress, req);
+    MagickBooleanType status = readMagickImage(baton, wand, frames);
+    baton->t[MagickStageDecode] = bkLap(t);
+    if (!status) {
+        if (!baton->exception) baton->exception = MagickGetException(wand, &baton->severity);
+        DestroyMagickWand(wand);
+        return;
+    }
+    setMagickMemory(baton);
+    int width = MagickGetImageWidth(wand);
+    int height = MagickGetImageHeight(wand);
+
+    vector<MagickBaton*> list = baton->list;
+    for (uint i = 0; i < list.size(); i++) {
+        MagickBaton *r = list[i];
+        r->o = baton->o;
+        r->scale = baton->scale;
+        r->d.orientation = baton->d.orientation;
+        // Keep the original format, the wand may come from a rendition with different format
+        if (r->format.empty() && !baton->in.width) r->format = baton->o.ext;
+        if (frames <= 1 && isMagickResizeOnly(r)) setMagickTargetSize(r, width, height);
+    }
+    std::stable_sort(list.begin(), list.end(), isMagickLarger);
+
+    MagickWand *prev = NULL;
+    MagickBaton *pbaton = NULL;
+    for (uint i = 0; i < list.size() && !bkWorkStatus(req); i++) {
+        MagickBaton *r = list[i];
+        // Invalid options, reported for this rendition only
+        if (r->err || r->exception) continue;
+        int rframes = frames;
+        bool simple = frames <= 1 && isMagickResizeOnly(r);
+        MagickWand *rwand;
+        if (simple && prev && r->d.cascade && r->d.width > 0 && r->d.height > 0 &&
+            (r->d.strip || !pbaton->d.strip) &&
+            pbaton->d.width >= r->d.width && pbaton->d.height >= r->d.height) {
+            rwand = cloneMagickCascade(req, wand, prev);
+        } else {
+            rwand = CloneMagickWand(wand);
+        }
+        status = transformMagickImage(req, r, rwand, rframes);
+        if (status) analyzeMagickImage(r, rwand, rframes);
+        r->t[MagickStageTransform] = bkLap(t) - r->t[MagickStageResize];
+        if (status) {
+            setMagickMemory(baton);
+            status = writeMagickImage(r, rwand, rframes);
+            r->t[MagickStageEncode] = bkLap(t);
+        }
+        if (!status && !r->exception) r->exception = MagickGetException(rwand, &r->severity);
+        if (simple && !r->exception && !r->err) {
+            if (prev) DestroyMagickWand(prev);
+            prev = rwand;
+            pbaton = r;
+        } else {
+            DestroyMagickWand(rwand);
+        }
+    }
+    if (prev) DestroyMagickWand(prev);
+    DestroyMagickWand(wand);
+}
+
+#define MAGICK_HIST_SIZE 26
+
+// Latency histogram, bucket i counts durations up to 2^i microseconds, the last one everything above
+struct MagickHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[MAGICK_HIST_SIZE];
+};
+
+struct MagickFormatStats {
+    uint64_t jobs;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    MagickHistogram total;
+};
+
+// Cumulative job stats of all environments
+static struct {
+    uv_mutex_t lock;
+    uint64_t jobs;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    MagickSizeType peak_memory;
+    MagickHistogram stages[MagickStageMax];
+    unordered_map<string, MagickFormatStats> formats;
+    unordered_map<string, uint64_t> severity;
+} stats;
+
+static void bkHistogramAdd(MagickHistogram &h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+    while (i < MAGICK_HIST_SIZE - 1 && us > (1ULL << i)) i++;
+    h.buckets[i]++;
+    h.count++;
+    h.sum += ns;
+    h.max = max(h.max, ns);
+}
+
+// Error class for stats: ImageMagick severity, system error or queue status
+static string getMagickErrorType(MagickBaton *baton, int status)
+{
+    switch (status) {
+    case 0:
+        break;
+    case UV_EBUSY:
+        return "queue";
+    case UV_E2BIG:
+        return "budget";
+    case UV_ECANCELED:
+        return "cancelled";
+    case UV_ETIMEDOUT:
+        return "timeout";
+    default:
+        return "system";
+    }
+    if (baton->err) return "system";
+    const char *str = CommandOptionToMnemonic(MagickExceptionOptions, baton->severity);
+    string type = str && baton->severity != UndefinedException ? str : "unknown";
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    return type;
+}
+
+// Account a finished job, only the stages that actually ran are added to the histograms
+static void putMagickStats(MagickBaton *baton, int status)
+{
+    bool failed = status || baton->err || baton->exception;
+    uv_mutex_lock(&stats.lock);
+    stats.jobs++;
+    stats.bytes_in += baton->o.size;
+    stats.peak_memory = max(stats.peak_memory, baton->memory);
+    for (int i = 0; i < MagickStageMax; i++) {
+        if (baton->t[i]) bkHistogramAdd(stats.stages[i], baton->t[i]);
+    }
+    if (failed) {
+        stats.errors++;
+        stats.severity[getMagickErrorType(baton, status)]++;
+    } else {
+        stats.bytes_out += baton->length;
+    }
+    MagickFormatStats &f = stats.formats[baton->o.ext.size() ? baton->o.ext : "unknown"];
+    f.jobs++;
+    f.bytes_in += baton->o.size;
+    if (failed) f.errors++; else f.bytes_out += baton->length;
+    bkHistogramAdd(f.total, baton->t[MagickStageTotal]);
+    uv_mutex_unlock(&stats.lock);
+}
+
+// Parsed options only, without the source and results
+static void copyMagickOptions(MagickBaton *baton, const MagickBaton *from)
+{
+    baton->d = from->d;
+    baton->filter = from->filter;
+    baton->format = from->format;
+    baton->bgcolor = from->bgcolor;
+    baton->engine = from->engine;
+    baton->out = from->out;
+    baton->timeout = from->timeout;
+}
+
+// Set one option from its string value, returns an error for unknown options or invalid values
+// Numeric option within the range, anything else is an error naming the option
+template <typename T>
+static string setMagickNumber(T &out, const char *key, const char *val, double min, double max)
+{
+    char *end;
+    double num = strtod(val, &end);
+    if (end == val || *end || !(num >= min && num <= max)) return "invalid " + string(key) + ": " + val;
+    out = (T)num;
+    return "";
+}
+
+static string setMagickOption(MagickBaton *baton, const char *key, const char *val)
+{
+    string err;
+    if (!strcmp(key, "posterize")) err = setMagickNumber(baton->d.posterize, key, val, 0, 256); else
+    if (!strcmp(key, "dither")) baton->d.dither = (DitherMethod)atoi(val); else
+    if (!strcmp(key, "normalize")) baton->d.normalize = (DitherMethod)atoi(val); else
+    if (!strcmp(key, "quantize")) err = setMagickNumber(baton->d.quantize, key, val, 0, 65536); else
+    if (!strcmp(key, "treedepth")) err = setMagickNumber(baton->d.tree_depth, key, val, 0, 8); else
+    if (!strcmp(key, "flip")) baton->d.flip = atoi(val); else
+    if (!strcmp(key, "strip")) baton->d.strip = atoi(val); else
+    if (!strcmp(key, "flop")) baton->d.flop = atoi(val); else
+    if (!strcmp(key, "width")) baton->d.width = atoi(val); else
+    if (!strcmp(key, "height")) baton->d.height = atoi(val); else
+    if (!strcmp(key, "quality")) err = setMagickNumber(baton->d.quality, key, val, 0, 100); else
+    if (!strcmp(key, "blur_radius")) baton->d.blur_radius = atof(val); else
+    if (!strcmp(key, "blur_sigma")) baton->d.blur_sigma = atof(val); else
+    if (!strcmp(key, "sharpen_radius")) baton->d.sharpen_radius = atof(val); else
+    if (!strcmp(key, "sharpen_sigma")) baton->d.sharpen_sigma = atof(val); else
+    if (!strcmp(key, "brightness")) baton->d.brightness = atof(val); else
+    if (!strcmp(key, "contrast")) baton->d.contrast = atof(val); else
+    if (!strcmp(key, "rotate")) baton->d.rotate = atof(val); else
+    if (!strcmp(key, "no_animation")) baton->d.no_animation = atof(val); else
+    if (!strcmp(key, "frame")) err = setMagickNumber(baton->d.frame, key, val, -1, INT_MAX); else
+    if (!strcmp(key, "shrink")) baton->d.shrink = atoi(val); else
+    if (!strcmp(key, "cascade")) baton->d.cascade = atoi(val); else
+    if (!strcmp(key, "strict")) baton->d.strict = atoi(val); else
+    if (!strcmp(key, "reorder")) baton->d.reorder = atoi(val); else
+    if (!strcmp(key, "engine")) baton->engine = val; else
+    if (!strcmp(key, "timeout")) err = setMagickNumber(baton->timeout, key, val, 0, INT_MAX); else
+    if (!strcmp(key, "raw")) {
+        string layout = getMagickLayout(val);
+        if (layout.empty()) err = "invalid raw layout: " + string(val);
+        strcpy(baton->d.raw, layout.c_str());
+    } else
+    if (!strcmp(key, "storage")) {
+        baton->d.storage = getMagickStorage(val);
+        if (baton->d.storage == UndefinedPixel) {
+            err = "invalid storage: " + string(val);
+            baton->d.storage = CharPixel;
+        }
+    } else
+    if (!strcmp(key, "profile")) {
+        baton->d.profile = getMagickProfile(val);
+        if (baton->d.profile < 0) {
+            err = "invalid profile: " + string(val);
+            baton->d.profile = MagickProfileNone;
+        }
+    } else
+    if (!strcmp(key, "progressive")) baton->d.progressive = atoi(val); else
+    if (!strcmp(key, "optimize")) baton->d.optimize = atoi(val); else
+    if (!strcmp(key, "sampling")) {
+        if (!getMagickSampling(val, baton->d.sampling_h, baton->d.sampling_v)) err = "invalid sampling: " + string(val);
+    } else
+    if (!strcmp(key, "dct")) {
+        if (strcmp(val, "islow") && strcmp(val, "ifast") && strcmp(val, "float")) err = "invalid dct: " + string(val); else
+        strcpy(baton->d.dct, val);
+    } else
+    if (!strcmp(key, "png_level")) err = setMagickNumber(baton->d.png_level, key, val, 0, 9); else
+    if (!strcmp(key, "png_strategy")) err = setMagickNumber(baton->d.png_strategy, key, val, 0, 4); else
+    if (!strcmp(key, "png_filter")) err = setMagickNumber(baton->d.png_filter, key, val, 0, 5); else
+    if (!strcmp(key, "webp_method")) err = setMagickNumber(baton->d.webp_method, key, val, 0, 6); else
+    if (!strcmp(key, "lossless")) baton->d.lossless = atoi(val); else
+    if (!strcmp(key, "alpha_quality")) err = setMagickNumber(baton->d.alpha_quality, key, val, 0, 100); else
+    if (!strcmp(key, "speed")) err = setMagickNumber(baton->d.speed, key, val, 0, 9); else
+    if (!strcmp(key, "analyze")) {
+        // Comma separated names with optional values: dhash, colors=5, blurhash=4x3
+        vector<string> list = bkStrSplit(val, ",", "");
+        for (uint i = 0; i < list.size(); i++) {
+            string::size_type eq = list[i].find('=');
+            string name = list[i].substr(0, eq), v = eq != string::npos ? list[i].substr(eq + 1) : "";
+            bool on = v != "false" && v != "0";
+            if (name == "dhash") baton->d.dhash = on; else
+            if (name == "colors") baton->d.colors = atoi(v.c_str()) > 0 ? min(atoi(v.c_str()), 256) : on ? 5 : 0; else
+            if (name == "blurhash") {
+                // XxY with 1 - 9 components each, a flag means 4x3
+                int x = 0, y = 0, n = 0;
+                if (sscanf(v.c_str(), "%dx%d%n", &x, &y, &n) == 2 && !v[n]) {
+                    if (x < 1 || x > 9 || y < 1 || y > 9) err = "invalid blurhash components: " + v;
+                } else
+                if (v.empty() || v == "true" || v == "1") {
+                    x = 4, y = 3;
+                } else
+                if (on) {
+                    err = "invalid blurhash components: " + v;
+                }
+                if (!err.empty()) x = y = 0;
+                baton->d.blurhash_x = x;
+                baton->d.blurhash_y = y;
+            } else {
+                err = "invalid analyze: " + name;
+            }
+        }
+    } else
+    if (!strcmp(key, "cache")) baton->d.cache = atoi(val); else
+    if (!strcmp(key, "max_frames")) err = setMagickNumber(baton->d.max_frames, key, val, 0, INT_MAX); else
+    if (!strcmp(key, "max_frame_pixels")) err = setMagickNumber(baton->d.max_frame_pixels, key, val, 0, HUGE_VAL); else
+    if (!strcmp(key, "frame_threads")) err = setMagickNumber(baton->d.frame_threads, key, val, 0, INT_MAX); else
+    if (!strcmp(key, "opacity")) err = setMagickNumber(baton->d.opacity, key, val, 0, 1); else
+    if (!strcmp(key, "crop_width")) err = setMagickNumber(baton->d.crop_width, key, val, 0, INT_MAX); else
+    if (!strcmp(key, "crop_height")) err = setMagickNumber(baton->d.crop_height, key, val, 0, INT_MAX); else
+    if (!strcmp(key, "crop_x")) baton->d.crop_x = atoi(val); else
+    if (!strcmp(key, "crop_y")) baton->d.crop_y = atoi(val); else
+    if (!strcmp(key, "bgcolor")) baton->bgcolor = val; else
+    if (!strcmp(key, "outfile")) baton->out = val; else
+    if (!strcmp(key, "ext")) baton->format = val; else
+    if (!strcmp(key, "filter")) {
+        baton->filter = getMagickFilter(val);
+        if (baton->filter == LanczosFilter && strcmp(val, "lanczos")) err = "invalid filter: " + string(val);
+    } else
+    if (!strcmp(key, "gravity")) {
+        baton->d.gravity = getMagickGravity(val);
+        if (baton->d.gravity == UndefinedGravity) err = "invalid gravity: " + string(val);
+    } else
+    if (!strcmp(key, "colorspace")) {
+        baton->d.colorspace = getMagickColorspace(val);
+        if (baton->d.colorspace == UndefinedColorspace) err = "invalid colorspace: " + string(val);
+    } else
+    if (strcmp(key, "preset") && strcmp(key, "buffer") && strcmp(key, "precision") && strcmp(key, "outfd")) err = "unknown option: " + string(key);
+    return err;
+}
+
+#ifndef WAND_NO_NODE
+
+// Result image as a Buffer which takes ownership of the blob, no copy, null if saved into a file
+static Local<Value> getImageData(MagickBaton *baton)
+{
+    if (baton->output_data && baton->out.empty()) return Nan::New(baton->output);
+    if (!baton->image) return Nan::Null();
+    Local<Object> buf;
+    if (baton->image_ref) {
+        buf = Nan::NewBuffer((char*)baton->image, baton->length, freeSharedBuffer, baton->image_ref).ToLocalChecked();
+    } else {
+        buf = Nan::NewBuffer((char*)baton->image, baton->length, baton->image_malloc ? freeBuffer : freeMagickBuffer, NULL).ToLocalChecked();
+    }
+    baton->image = NULL;
+    baton->image_ref = NULL;
+    return buf;
+}
+
+static Local<Object> getImageInfo(MagickBaton *baton)
+{
+    Local<Object> info = Nan::New<Object>();
+    Nan::Set(info, Nan::New("ext").ToLocalChecked(), Nan::New(baton->ext).ToLocalChecked());
+    if (baton->out.size()) Nan::Set(info, Nan::New("file").ToLocalChecked(), Nan::New(baton->out).ToLocalChecked());
+    if (baton->d.orientation) {
+        Nan::Set(info, Nan::New("orientation").ToLocalChecked(), Nan::New(getMagickOrientation(baton->d.orientation)).ToLocalChecked());
+        Nan::Set(info, Nan::New("rotation").ToLocalChecked(), Nan::New(getMagickAngle(baton->d.orientation)));
+    }
+    Nan::Set(info, Nan::New("width").ToLocalChecked(), Nan::New(baton->d.width));
+    Nan::Set(info, Nan::New("height").ToLocalChecked(), Nan::New(baton->d.height));
+    Nan::Set(info, Nan::New("_width").ToLocalChecked(), Nan::New(baton->o.width));
+    Nan::Set(info, Nan::New("_height").ToLocalChecked(), Nan::New(baton->o.height));
+    if (baton->o.ext.size()) Nan::Set(info, Nan::New("_ext").ToLocalChecked(), Nan::New(baton->o.ext).ToLocalChecked());
+    if (baton->o.orientation) {
+        Nan::Set(info, Nan::New("_orientation").ToLocalChecked(), Nan::New(getMagickOrientation(baton->o.orientation)).ToLocalChecked());
+        Nan::Set(info, Nan::New("_rotation").ToLocalChecked(), Nan::New(getMagickAngle(baton->o.orientation)));
+    }
+    if (baton->d.raw[0]) {
+        string layout = baton->d.raw;
+        std::transform(layout.begin(), layout.end(), layout.begin(), ::tolower);
+        Nan::Set(info, Nan::New("layout").ToLocalChecked(), Nan::New(layout).ToLocalChecked());
+        Nan::Set(info, Nan::New("storage").ToLocalChecked(), Nan::New(getMagickStorageName(baton->d.storage)).ToLocalChecked());
+    }
+    if (baton->a.dhash.size()) Nan::Set(info, Nan::New("dhash").ToLocalChecked(), Nan::New(baton->a.dhash).ToLocalChecked());
+    if (baton->d.colors > 0) {
+        Local<Array> colors = Nan::New<Array>((int)baton->a.colors.size());
+        for (uint i = 0; i < baton->a.colors.size(); i++) Nan::Set(colors, i, Nan::New(baton->a.colors[i]).ToLocalChecked());
+        Nan::Set(info, Nan::New("colors").ToLocalChecked(), colors);
+    }
+    if (baton->a.blurhash.size()) Nan::Set(info, Nan::New("blurhash").ToLocalChecked(), Nan::New(baton->a.blurhash).ToLocalChecked());
+    // Encoded or raw size in bytes, encoding time is in timings
+    Nan::Set(info, Nan::New("length").ToLocalChecked(), Nan::New((double)baton->length));
+    // Stage durations in milliseconds
+    Local<Object> timings = Nan::New<Object>();
+    for (int i = 0; i < MagickStageMax; i++) {
+        Nan::Set(timings, Nan::New(magickStages[i]).ToLocalChecked(), Nan::New(baton->t[i] / 1e6));
+    }
+    Nan::Set(info, Nan::New("timings").ToLocalChecked(), timings);
+    return info;
+}
+
+static void afterResizeImage(WandWork *req, int status)
+{
+    Nan::HandleScope scope;
+    MagickBaton *baton = (MagickBaton *)req->data;
+
+    // The same request was running, wait for its result
+    if (baton->cache_running) {
+        baton->cache_running = false;
+        if (!status && (req->cancelled || env->closing)) status = UV_ECANCELED;
+        if (!status && waitMagickCache(req)) return;
+        if (status) baton->cache_key.clear();
+    }
+    // The deadline passed after the result was ready, it is returned, a cancelled job does not leave its file behind
+    if (status == UV_ETIMEDOUT && baton->complete) status = 0;
+    if (status && baton->complete && baton->out.size()) unlink(baton->out.c_str());
+    if (baton->cache_key.size()) finishMagickCache(req, status);
+    if (baton->cache_hit) env->cache.disk_hits++;
+    baton->t[MagickStageTotal] = uv_hrtime() - baton->start;
+    putMagickStats(baton, status);
+
+    Local<Value> argv[3];
+
+    if (!baton->cb.IsEmpty()) {
+        Local<Function> cb = Nan::New(baton->cb);
+        if (status) {
+            argv[0] = Nan::Error(bkStrStatus(status));
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else
+        if (baton->err || baton->exception) {
+            argv[0] = Nan::Error(baton->err ? strerror(baton->err) : baton->exception);
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else {
+            argv[0] = Nan::Null();
+            argv[1] = getImageData(baton);
+            argv[2] = getImageInfo(baton);
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 3, argv);
+        }
+    }
+    freeMagickImage(baton);
+    if (baton->exception) MagickRelinquishMemory(baton->exception);
+    delete baton;
+    delete req;
+}
+
+// Read only image properties without decoding pixels
+static void doProbeImage(WandWork *req)
+{
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickWand *wand = NewMagickWand();
+    ExceptionType severity;
+
+    if (!pingMagickImage(baton, wand)) baton->exception = MagickGetException(wand, &severity);
+    DestroyMagickWand(wand);
+}
+
+static void afterProbeImage(WandWork *req, int status)
+{
+    Nan::HandleScope scope;
+    MagickBaton *baton = (MagickBaton *)req->data;
+
+    Local<Value> argv[2];
+
+    if (!baton->cb.IsEmpty()) {
+        Local<Function> cb = Nan::New(baton->cb);
+        if (status) {
+            argv[0] = Nan::Error(bkStrStatus(status));
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else
+        if (baton->exception) {
+            argv[0] = Nan::Error(baton->exception);
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else {
+            Local<Object> info = Nan::New<Object>();
+            Nan::Set(info, Nan::New("ext").ToLocalChecked(), Nan::New(baton->o.ext).ToLocalChecked());
+            Nan::Set(info, Nan::New("width").ToLocalChecked(), Nan::New(baton->o.width));
+            Nan::Set(info, Nan::New("height").ToLocalChecked(), Nan::New(baton->o.height));
+            Nan::Set(info, Nan::New("frames").ToLocalChecked(), Nan::New(baton->o.frames));
+            Nan::Set(info, Nan::New("colorspace").ToLocalChecked(), Nan::New(baton->o.colorspace).ToLocalChecked());
+            Nan::Set(info, Nan::New("alpha").ToLocalChecked(), Nan::New((bool)baton->o.alpha));
+            if (baton->o.orientation) {
+                Nan::Set(info, Nan::New("orientation").ToLocalChecked(), Nan::New(getMagickOrientation(baton->o.orientation)).ToLocalChecked());
+                Nan::Set(info, Nan::New("rotation").ToLocalChecked(), Nan::New(getMagickAngle(baton->o.orientation)));
+            }
+            argv[0] = Nan::Null();
+            argv[1] = info;
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 2, argv);
+        }
+    }
+    if (baton->exception) MagickRelinquishMemory(baton->exception);
+    delete baton;
+    delete req;
+}
+
+static void afterResizeImages(WandWork *req, int status)
+{
+    Nan::HandleScope scope;
+    MagickBaton *baton = (MagickBaton *)req->data;
+
+    // Renditions share the queue and decode stages of the source, the source is accounted once
+    baton->t[MagickStageTotal] = uv_hrtime() - baton->start;
+    // Only the source failure fails the whole call, rendition errors are counted in stats and reported per rendition
+    int err = baton->err;
+    string exception = baton->exception ? baton->exception : "";
+    for (uint i = 0; i < baton->list.size(); i++) {
+        MagickBaton *r = baton->list[i];
+        r->t[MagickStageQueue] = baton->t[MagickStageQueue];
+        r->t[MagickStageDecode] = baton->t[MagickStageDecode];
+        r->t[MagickStageTotal] = baton->t[MagickStageTotal];
+        for (int j = MagickStageTransform; j <= MagickStageEncode; j++) baton->t[j] += r->t[j];
+        baton->length += r->length;
+        if (!baton->err && !baton->exception) {
+            baton->err = r->err;
+            baton->severity = r->severity;
+            if (r->exception) baton->exception = AcquireString(r->exception);
+        }
+    }
+    putMagickStats(baton, status);
+
+    Local<Value> argv[3];
+
+    if (!baton->cb.IsEmpty()) {
+        Local<Function> cb = Nan::New(baton->cb);
+        if (status) {
+            argv[0] = Nan::Error(bkStrStatus(status));
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else
+        if (err || exception.size()) {
+            argv[0] = Nan::Error(err ? strerror(err) : exception.c_str());
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 1, argv);
+        } else {
+            Local<Array> data = Nan::New<Array>((int)baton->list.size());
+            Local<Array> info = Nan::New<Array>((int)baton->list.size());
+            for (uint i = 0; i < baton->list.size(); i++) {
+                MagickBaton *r = baton->list[i];
+                // Failed renditions have null data and only the error in the info
+                if (r->err || r->exception) {
+                    Local<Object> obj = Nan::New<Object>();
+                    Nan::Set(obj, Nan::New("error").ToLocalChecked(), Nan::New(r->err ? strerror(r->err) : r->exception).ToLocalChecked());
+                    Nan::Set(data, i, Nan::Null());
+                    Nan::Set(info, i, obj);
+                    continue;
+                }
+                Nan::Set(data, i, getImageData(r));
+                Nan::Set(info, i, getImageInfo(r));
+            }
+            argv[0] = Nan::Null();
+            argv[1] = data;
+            argv[2] = info;
+            NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), cb, 3, argv);
+        }
+    }
+    for (uint i = 0; i < baton->list.size(); i++) {
+        MagickBaton *r = baton->list[i];
+        freeMagickImage(r);
+        if (r->exception) MagickRelinquishMemory(r->exception);
+    }
+    if (baton->exception) MagickRelinquishMemory(baton->exception);
+    delete baton;
+    delete req;
+}
+
+// Returns an error for unknown options or invalid values, they are ignored otherwise
+static string parseMagickOptions(MagickBaton *baton, Local<Object> opts)
+{
+    string err;
+    const Local<Array> names = Nan::GetPropertyNames(opts).ToLocalChecked();
+    for (uint i = 0 ; i < names->Length(); ++i) {
+        Nan::Utf8String key(Nan::Get(names, i).ToLocalChecked());
+        Local<Value> value = Nan::Get(opts, Nan::Get(names, i).ToLocalChecked()).ToLocalChecked();
+        // Analyze as an object is the same as the list of name=value
+        if (!strcmp(*key, "analyze") && value->IsObject()) {
+            Local<Object> obj = Nan::To<Object>(value).ToLocalChecked();
+            const Local<Array> items = Nan::GetPropertyNames(obj).ToLocalChecked();
+            for (uint j = 0; j < items->Length(); j++) {
+                Nan::Utf8String name(Nan::Get(items, j).ToLocalChecked());
+                Nan::Utf8String val(Nan::Get(obj, Nan::Get(items, j).ToLocalChecked()).ToLocalChecked());
+                string e = setMagickOption(baton, *key, (string(*name) + "=" + *val).c_str());
+                if (e.size()) err = e;
+            }
+            continue;
+        }
+        Nan::Utf8String val(value);
+        string e = setMagickOption(baton, *key, *val);
+        if (e.size()) err = e;
+    }
+    return err;
+}
+
+// Options parsed once by compilePreset and copied into each job
+class MagickPreset : public Nan::ObjectWrap {
+public:
+    MagickBaton baton;
+
+    static NAN_METHOD(New) {
+        if (!info.IsConstructCall()) {
+            Nan::ThrowError("use compilePreset");
+            return;
+        }
+        MagickPreset *preset = new MagickPreset;
+        preset->Wrap(info.This());
+        info.GetReturnValue().Set(info.This());
+    }
+};
+
+static MagickBaton *getMagickPreset(Local<Value> value)
+{
+    if (!value->IsObject() || !Nan::New(env->preset)->HasInstance(value)) return NULL;
+    return &Nan::ObjectWrap::Unwrap<MagickPreset>(Nan::To<Object>(value).ToLocalChecked())->baton;
+}
+
+// Options can be a preset, or an object with optional preset property and other options to override it,
+// returns the last invalid option error
+static string setMagickOptions(MagickBaton *baton, Local<Object> opts)
+{
+    string err;
+    MagickBaton *preset = getMagickPreset(opts);
+    bool compiled = preset != NULL;
+    if (!compiled) preset = getMagickPreset(Nan::Get(opts, Nan::New("preset").ToLocalChecked()).ToLocalChecked());
+    if (preset) copyMagickOptions(baton, preset);
+    if (!compiled) err = parseMagickOptions(baton, opts);
+
+    // Raw pixels are exported into the caller Buffer if it is big enough
+    if (baton->d.raw[0] && !compiled) {
+        Local<Value> buf = Nan::Get(opts, Nan::New("buffer").ToLocalChecked()).ToLocalChecked();
+        if (Buffer::HasInstance(buf)) {
+            baton->output.Reset(Nan::To<Object>(buf).ToLocalChecked());
+            baton->output_data = (unsigned char*)Buffer::Data(buf);
+            baton->output_length = Buffer::Length(buf);
+        }
+    }
+    // The caller may close its descriptor right after the call
+    if (!compiled) {
+        Local<Value> fd = Nan::Get(opts, Nan::New("outfd").ToLocalChecked()).ToLocalChecked();
+        if (fd->IsNumber()) {
+            baton->out_fd = fcntl(Nan::To<int32_t>(fd).FromJust(), F_DUPFD_CLOEXEC, 0);
+            if (baton->out_fd < 0) baton->err = errno;
+        }
+    }
+    return err;
+}
+
+// Invalid options fail the job through its callback like any other error, the job is not run
+static void setMagickOptionsError(MagickBaton *baton, const string &err)
+{
+    if (err.empty() || baton->exception) return;
+    baton->exception = AcquireString(err.c_str());
+    baton->severity = OptionError;
+}
+
+// Source can be a Buffer which is read in place, raw pixels as { data, width, height, layout, storage }, a file descriptor
+// as { fd, ext } or a file name
+static void setMagickSource(MagickBaton *baton, Local<Value> source)
+{
+    if (Buffer::HasInstance(source)) {
+        Local<Object> buf = Nan::To<Object>(source).ToLocalChecked();
+        baton->buffer.Reset(buf);
+        baton->blob_length = Buffer::Length(buf);
+        baton->blob = (const unsigned char*)Buffer::Data(buf);
+    } else
+    if (source->IsObject()) {
+        Local<Object> obj = Nan::To<Object>(source).ToLocalChecked();
+        Local<Value> fd = Nan::Get(obj, Nan::New("fd").ToLocalChecked()).ToLocalChecked();
+        if (fd->IsNumber()) {
+            baton->fd = fcntl(Nan::To<int32_t>(fd).FromJust(), F_DUPFD_CLOEXEC, 0);
+            if (baton->fd < 0) baton->err = errno;
+            // Regular files are read from the current offset, pinged first like files given by name
+            struct stat st;
+            if (baton->fd >= 0 && !fstat(baton->fd, &st) && S_ISREG(st.st_mode)) baton->fd_offset = lseek(baton->fd, 0, SEEK_CUR);
+            Local<Value> ext = Nan::Get(obj, Nan::New("ext").ToLocalChecked()).ToLocalChecked();
+            if (!ext->IsUndefined()) baton->in.ext = *Nan::Utf8String(ext);
+            return;
+        }
+        Local<Value> data = Nan::Get(obj, Nan::New("data").ToLocalChecked()).ToLocalChecked();
+        if (Buffer::HasInstance(data)) {
+            baton->buffer.Reset(Nan::To<Object>(data).ToLocalChecked());
+            baton->blob_length = Buffer::Length(data);
+            baton->blob = (const unsigned char*)Buffer::Data(data);
+        }
+        // Invalid values are reported by the job
+        baton->in.width = Nan::To<int32_t>(Nan::Get(obj, Nan::New("width").ToLocalChecked()).ToLocalChecked()).FromMaybe(0);
+        baton->in.height = Nan::To<int32_t>(Nan::Get(obj, Nan::New("height").ToLocalChecked()).ToLocalChecked()).FromMaybe(0);
+        if (baton->in.width <= 0) baton->in.width = -1;
+        Nan::Utf8String layout(Nan::Get(obj, Nan::New("layout").ToLocalChecked()).ToLocalChecked());
+        baton->in.layout = getMagickLayout(*layout);
+        Local<Value> storage = Nan::Get(obj, Nan::New("storage").ToLocalChecked()).ToLocalChecked();
+        if (!storage->IsUndefined()) {
+            Nan::Utf8String name(storage);
+            baton->in.storage = getMagickStorage(*name);
+        }
+    } else {
+        Nan::Utf8String name(source);
+        baton->path = *name;
+    }
+}
+
+static NAN_METHOD(resizeImage)
+{
+    NAN_REQUIRE_ARGUMENT(0);
+    NAN_REQUIRE_ARGUMENT_OBJECT(1, opts);
+
+    WandWork *req = new WandWork;
+    MagickBaton *baton = new MagickBaton;
+    req->data = baton;
+    if (info.Length() > 2 && info[2]->IsFunction()) {
+        baton->cb.Reset(Local<Function>::Cast(info[2]));
+    }
+
+    setMagickOptionsError(baton, setMagickOptions(baton, opts));
+
+    setMagickSource(baton, info[0]);
+    baton->start = uv_hrtime();
+    if (baton->timeout > 0) req->deadline = baton->start + baton->timeout * 1000000ULL;
+    req->cost_cb = getMagickImageCost;
+    if (baton->err || baton->exception) {
+        bkCompleteWork(req, afterResizeImage, 0);
+        return;
+    }
+
+    // The key is computed and the cache is checked by the job itself
+    baton->cache_lookup = env->cache.max_size && baton->d.cache && baton->out.empty() && !baton->output_data && baton->fd < 0 && baton->out_fd < 0;
+    bkQueueWork(req, doResizeImage, afterResizeImage);
+    info.GetReturnValue().Set(Nan::New(req->id));
+}
+
+static NAN_METHOD(resizeImages)
+{
+    NAN_REQUIRE_ARGUMENT(0);
+    if (info.Length() <= 1 || !info[1]->IsArray()) {
+        Nan::ThrowError("Argument 1 must be an array");
+        return;
+    }
+    Local<Array> list = Local<Array>::Cast(info[1]);
+
+    WandWork *req = new WandWork;
+    MagickBaton *baton = new MagickBaton;
+    req->data = baton;
+    if (info.Length() > 2 && info[2]->IsFunction()) {
+        baton->cb.Reset(Local<Function>::Cast(info[2]));
+    }
+
+    // Reduced decode size must fit the largest rendition
+    baton->d.shrink = list->Length() > 0;
+    for (uint i = 0; i < list->Length(); i++) {
+        Local<Value> opts = Nan::Get(list, i).ToLocalChecked();
+        MagickBaton *r = new MagickBaton;
+        if (opts->IsObject()) setMagickOptionsError(r, setMagickOptions(r, Nan::To<Object>(opts).ToLocalChecked()));
+        baton->list.push_back(r);
+        if (!r->d.shrink || r->d.rotate || (!r->d.width && !r->d.height) || (r->d.crop_width && r->d.crop_height)) baton->d.shrink = 0;
+        baton->d.width = max(baton->d.width, abs(r->d.width));
+        baton->d.height = max(baton->d.height, abs(r->d.height));
+    }
+
+    setMagickSource(baton, info[0]);
+    baton->start = uv_hrtime();
+
+    req->cost_cb = getMagickImageCost;
+    bkQueueWork(req, doResizeImages, afterResizeImages);
+    info.GetReturnValue().Set(Nan::New(req->id));
+}
+
+// Bulk conversion of many files with the same options, owned by the event loop thread
+struct MagickBatch {
+    MagickBatch(): next(0), running(0), concurrency(0), interval(0), done(0), errors(0), bytes_in(0), bytes_out(0), start(0) {}
+    ~MagickBatch() {
+        cb.Reset();
+        progress.Reset();
+    }
+    MagickBaton opts;
+    string dir;
+    string output;
+    vector<string> files;
+    // Number of inputs by output name without the source extension
+    unordered_map<string, int> names;
+    size_t next;
+    int running;
+    int concurrency;
+    int interval;
+    uint64_t done;
+    uint64_t errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t start;
+    // Directory walk or cancellation error, no more files are queued
+    string error;
+    // Files failed since the last progress report
+    vector<pair<string, string> > failed;
+    WandWork walk;
+    uv_timer_t timer;
+    Nan::Persistent<Function> cb;
+    Nan::Persistent<Function> progress;
+};
+
+// One file of a batch, the output path is without extension
+struct MagickBatchWork : public WandWork {
+    MagickBatch *batch;
+    string file;
+    string out;
+};
+
+// Regular files of the directory tree, hidden files and symlinks to directories are skipped
+static int bkWalkDir(const string &dir, vector<string> &files)
+{
+    DIR *dp = opendir(dir.c_str());
+    if (!dp) return errno;
+    vector<string> dirs;
+    struct dirent *ent;
+    while ((ent = readdir(dp))) {
+        if (ent->d_name[0] == '.') continue;
+        string path = dir + "/" + ent->d_name;
+        int type = ent->d_type;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat st;
+            if (stat(path.c_str(), &st)) continue;
+            type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && type == DT_UNKNOWN ? DT_DIR : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) dirs.push_back(path); else
+        if (type == DT_REG) files.push_back(path);
+    }
+    closedir(dp);
+    for (uint i = 0; i < dirs.size(); i++) bkWalkDir(dirs[i], files);
+    return 0;
+}
+
+static void doWalkBatch(WandWork *req)
+{
+    MagickBatch *batch = (MagickBatch *)req->data;
+    int err = bkWalkDir(batch->dir, batch->files);
+    if (err) batch->error = strerror(err);
+    std::sort(batch->files.begin(), batch->files.end());
+}
+
+// Write into a hidden temp file next to the destination and rename it so readers never see partial images
+// Permissions of new files, mkstemp creates them readable by the owner only
+static mode_t bkUmask;
+
+static void doConvertFile(WandWork *work)
+{
+    MagickBatchWork *req = (MagickBatchWork *)work;
+    MagickBaton *baton = (MagickBaton *)req->data;
+
+    // Unique hidden temp file next to the destination, the image is encoded into it and renamed when complete
+    string::size_type slash = req->out.find_last_of('/');
+    string tmp = req->out.substr(0, slash + 1) + "." + req->out.substr(slash + 1) + ".XXXXXX";
+    errno = 0;
+    if (!bkMakePath(tmp) || (baton->out_fd = mkostemp(&tmp[0], O_CLOEXEC)) < 0) {
+        baton->err = errno ? errno : EIO;
+        return;
+    }
+    fchmod(baton->out_fd, 0666 & ~bkUmask);
+
+    doResizeImage(req);
+
+    if (baton->err || baton->exception || bkWorkStatus(req)) {
+        unlink(tmp.c_str());
+        return;
+    }
+    string path = req->out + "." + baton->ext;
+    if (rename(tmp.c_str(), path.c_str())) {
+        baton->err = errno;
+        unlink(tmp.c_str());
+        return;
+    }
+    baton->out = path;
+}
+
+// Batch progress and totals, failed files are reported once
+static Local<Object> getBatchInfo(MagickBatch *batch)
+{
+    Local<Object> info = Nan::New<Object>();
+    double elapsed = (uv_hrtime() - batch->start) / 1e6;
+    Nan::Set(info, Nan::New("total").ToLocalChecked(), Nan::New((double)batch->files.size()));
+    Nan::Set(info, Nan::New("done").ToLocalChecked(), Nan::New((double)batch->done));
+    Nan::Set(info, Nan::New("errors").ToLocalChecked(), Nan::New((double)batch->errors));
+    Nan::Set(info, Nan::New("bytes_in").ToLocalChecked(), Nan::New((double)batch->bytes_in));
+    Nan::Set(info, Nan::New("bytes_out").ToLocalChecked(), Nan::New((double)batch->bytes_out));
+    Nan::Set(info, Nan::New("elapsed").ToLocalChecked(), Nan::New(elapsed));
+    Nan::Set(info, Nan::New("rate").ToLocalChecked(), Nan::New(elapsed > 0 ? batch->done * 1000 / elapsed : 0));
+    Local<Array> failed = Nan::New<Array>((int)batch->failed.size());
+    for (uint i = 0; i < batch->failed.size(); i++) {
+        Local<Object> f = Nan::New<Object>();
+        Nan::Set(f, Nan::New("file").ToLocalChecked(), Nan::New(batch->failed[i].first).ToLocalChecked());
+        Nan::Set(f, Nan::New("error").ToLocalChecked(), Nan::New(batch->failed[i].second).ToLocalChecked());
+        Nan::Set(failed, i, f);
+    }
+    batch->failed.clear();
+    Nan::Set(info, Nan::New("failed").ToLocalChecked(), failed);
+    return info;
+}
+
+static void progressMagickBatch(uv_timer_t *handle)
+{
+    Nan::HandleScope scope;
+    MagickBatch *batch = (MagickBatch *)handle->data;
+    Local<Value> argv[1] = { getBatchInfo(batch) };
+    NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), Nan::New(batch->progress), 1, argv);
+}
+
+static void freeMagickBatch(uv_handle_t *handle)
+{
+    delete (MagickBatch *)handle->data;
+}
+
+static void finishMagickBatch(MagickBatch *batch)
+{
+    Nan::HandleScope scope;
+    uv_timer_stop(&batch->timer);
+    if (!batch->cb.IsEmpty()) {
+        Local<Value> argv[2];
+        if (batch->error.size()) argv[0] = Nan::Error(batch->error.c_str()); else argv[0] = Nan::Null();
+        argv[1] = getBatchInfo(batch);
+        NAN_TRY_CATCH_CALL(Nan::GetCurrentContext()->Global(), Nan::New(batch->cb), 2, argv);
+    }
+    uv_close((uv_handle_t*)&batch->timer, freeMagickBatch);
+}
+
+static void afterConvertFile(WandWork *req, int status);
+
+// Output path without extension, the relative path under the source directory or just the file name,
+// the extension of the source is removed unless asked to keep it
+static string getBatchOutput(MagickBatch *batch, const string &file, bool ext)
+{
+    string::size_type slash = file.find_last_of('/');
+    string name = batch->dir.size() ? file.substr(batch->dir.size() + 1) : slash == string::npos ? file : file.substr(slash + 1);
+    string::size_type dot = name.find_last_of("./");
+    if (!ext && dot != string::npos && name[dot] == '.') name.erase(dot);
+    return batch->output + "/" + name;
+}
+
+// Keep up to concurrency files in the pool, the batch is finished when nothing is running
+static void runMagickBatch(MagickBatch *batch)
+{
+    while (batch->error.empty() && !env->closing && batch->running < batch->concurrency && batch->next < batch->files.size()) {
+        MagickBatchWork *req = new MagickBatchWork;
+        MagickBaton *baton = new MagickBaton;
+        req->data = baton;
+        req->batch = batch;
+        req->file = batch->files[batch->next++];
+
+        // Inputs like a.jpg and a.png would overwrite each other, they keep the source extension: a.jpg.webp, a.png.webp
+        req->out = getBatchOutput(batch, req->file, false);
+        if (batch->names[req->out] > 1) req->out = getBatchOutput(batch, req->file, true);
+
+        copyMagickOptions(baton, &batch->opts);
+        baton->path = req->file;
+        baton->start = uv_hrtime();
+        if (baton->timeout > 0) req->deadline = baton->start + baton->timeout * 1000000ULL;
+        req->cost_cb = getMagickImageCost;
+        batch->running++;
+        bkQueueWork(req, doConvertFile, afterConvertFile);
+    }
+    if (!batch->running) finishMagickBatch(batch);
+}
+
+static void afterWalkBatch(WandWork *req, int status)
+{
+    MagickBatch *batch = (MagickBatch *)req->data;
+    if (status) batch->error = bkStrStatus(status);
+    for (uint i = 0; i < batch->files.size(); i++) batch->names[getBatchOutput(batch, batch->files[i], false)]++;
+    runMagickBatch(batch);
+}
+
+static void afterConvertFile(WandWork *work, int status)
+{
+    MagickBatchWork *req = (MagickBatchWork *)work;
+    MagickBaton *baton = (MagickBaton *)req->data;
+    MagickBatch *batch = req->batch;
+
+    baton->t[MagickStageTotal] = uv_hrtime() - baton->start;
+    putMagickStats(baton, status);
+
+    batch->running--;
+    batch->done++;
+    batch->bytes_in += baton->o.size;
+    if (status || baton->err || baton->exception) {
+        batch->errors++;
+        batch->failed.push_back(make_pair(req->file, string(status ? bkStrStatus(status) : baton->err ? strerror(baton->err) : baton->exception)));
+    } else {
+        batch->bytes_out += baton->length;
+    }
+    freeMagickImage(baton);
+    if (baton->exception) MagickRelinquishMemory(baton->exception);
+    delete baton;
+    delete req;
+
+    runMagickBatch(batch);
+}
+
+static NAN_METHOD(convertBatch)
+{
+    NAN_REQUIRE_ARGUMENT_OBJECT(0, opts);
+
+    MagickBatch *batch = new MagickBatch;
+    if (info.Length() > 1 && info[1]->IsFunction()) {
+        batch->cb.Reset(Local<Function>::Cast(info[1]));
+    }
+    Local<Value> val = Nan::Get(opts, Nan::New("preset").ToLocalChecked()).ToLocalChecked();
+    if (val->IsObject()) {
+        string err = setMagickOptions(&batch->opts, Nan::To<Object>(val).ToLocalChecked());
+        if (err.size()) {
+            delete batch;
+            Nan::ThrowError(err.c_str());
+            return;
+        }
+    }
+    val = Nan::Get(opts, Nan::New("progress").ToLocalChecked()).ToLocalChecked();
+    if (val->IsFunction()) batch->progress.Reset(Local<Function>::Cast(val));
+    val = Nan::Get(opts, Nan::New("interval").ToLocalChecked()).ToLocalChecked();
+    batch->interval = val->IsUndefined() ? 1000 : Nan::To<int32_t>(val).FromMaybe(0);
+    val = Nan::Get(opts, Nan::New("concurrency").ToLocalChecked()).ToLocalChecked();
+    batch->concurrency = Nan::To<int32_t>(val).FromMaybe(0);
+    if (batch->concurrency <= 0) batch->concurrency = pool->workers;
+    val = Nan::Get(opts, Nan::New("outputDir").ToLocalChecked()).ToLocalChecked();
+    if (!val->IsUndefined()) batch->output = *Nan::Utf8String(val);
+    val = Nan::Get(opts, Nan::New("dir").ToLocalChecked()).ToLocalChecked();
+    if (!val->IsUndefined()) batch->dir = *Nan::Utf8String(val);
+    val = Nan::Get(opts, Nan::New("inputs").ToLocalChecked()).ToLocalChecked();
+    if (val->IsArray()) {
+        Local<Array> list = Local<Array>::Cast(val);
+        for (uint i = 0; i < list->Length(); i++) batch->files.push_back(*Nan::Utf8String(Nan::Get(list, i).ToLocalChecked()));
+    }
+    while (batch->dir.size() > 1 && batch->dir[batch->dir.size() - 1] == '/') batch->dir.erase(batch->dir.size() - 1);
+    while (batch->output.size() > 1 && batch->output[batch->output.size() - 1] == '/') batch->output.erase(batch->output.size() - 1);
+
+    if (batch->output.empty() || (batch->dir.empty() && !val->IsArray())) {
+        delete batch;
+        Nan::ThrowError("outputDir and dir or inputs are required");
+        return;
+    }
+
+    uv_timer_init(env->loop, &batch->timer);
+    batch->timer.data = batch;
+    uv_unref((uv_handle_t*)&batch->timer);
+    if (!batch->progress.IsEmpty() && batch->interval > 0) uv_timer_start(&batch->timer, progressMagickBatch, batch->interval, batch->interval);
+    batch->start = uv_hrtime();
+
+    // The directory is walked in the pool, the list of inputs is started asynchronously as well
+    batch->walk.data = batch;
+    if (batch->dir.size()) {
+        batch->files.clear();
+        bkQueueWork(&batch->walk, doWalkBatch, afterWalkBatch);
+    } else {
+        bkCompleteWork(&batch->walk, afterWalkBatch, 0);
+    }
+}
+
+static NAN_METHOD(compilePreset)
+{
+    NAN_REQUIRE_ARGUMENT_OBJECT(0, opts);
+
+    Local<Object> obj = Nan::NewInstance(Nan::GetFunction(Nan::New(env->preset)).ToLocalChecked(), 0, NULL).ToLocalChecked();
+    MagickPreset *preset = Nan::ObjectWrap::Unwrap<MagickPreset>(obj);
+    string err = parseMagickOptions(&preset->baton, opts);
+    if (err.size()) {
+        Nan::ThrowError(err.c_str());
+        return;
+    }
+    info.GetReturnValue().Set(obj);
+}
+
+static NAN_METHOD(cancelImage)
+{
+    NAN_REQUIRE_ARGUMENT(0);
+
+    uint32_t id = Nan::To<uint32_t>(info[0]).FromJust();
+    info.GetReturnValue().Set(Nan::New(id && bkCancelWork(id)));
+}
+
+static NAN_METHOD(probeImage)
+{
+    NAN_REQUIRE_ARGUMENT(0);
+
+    WandWork *req = new WandWork;
+    MagickBaton *baton = new MagickBaton;
+    req->data = baton;
+    if (info.Length() > 1 && info[1]->IsFunction()) {
+        baton->cb.Reset(Local<Function>::Cast(info[1]));
+    }
+    setMagickSource(baton, info[0]);
+
+    bkQueueWork(req, doProbeImage, afterProbeImage);
+}
+
+static NAN_METHOD(setCacheOptions)
+{
+    NAN_REQUIRE_ARGUMENT_OBJECT(0, opts);
+    MagickCache &cache = env->cache;
+
+    const Local<Array> names = Nan::GetPropertyNames(opts).ToLocalChecked();
+    uv_mutex_lock(&cache.lock);
+    for (uint i = 0 ; i < names->Length(); ++i) {
+        Nan::Utf8String key(Nan::Get(names, i).ToLocalChecked());
+        Nan::Utf8String val(Nan::Get(opts, Nan::Get(names, i).ToLocalChecked()).ToLocalChecked());
+        if (!strcmp(*key, "size")) cache.max_size = atoll(*val); else
+        if (!strcmp(*key, "dir")) cache.dir = *val; else
+        if (!strcmp(*key, "disk_size")) cache.disk_max_size = atoll(*val); else
+        if (!strcmp(*key, "disk_age")) cache.disk_max_age = atoi(*val);
+    }
+    // Shrink or clear the memory cache, apply the disk limits to the existing files
+    evictMagickCache(cache);
+    uv_mutex_unlock(&cache.lock);
+    if (cache.dir.size()) bkMakePath(cache.dir + "/");
+    checkMagickCacheDir(0, true);
+}
+
+static NAN_METHOD(getCacheStats)
+{
+    MagickCache &cache = env->cache;
+    Local<Object> obj = Nan::New<Object>();
+    uv_mutex_lock(&cache.lock);
+    Nan::Set(obj, Nan::New("hits").ToLocalChecked(), Nan::New((double)cache.hits));
+    Nan::Set(obj, Nan::New("misses").ToLocalChecked(), Nan::New((double)cache.misses));
+    Nan::Set(obj, Nan::New("coalesced").ToLocalChecked(), Nan::New((double)cache.coalesced));
+    Nan::Set(obj, Nan::New("evictions").ToLocalChecked(), Nan::New((double)cache.evictions));
+    Nan::Set(obj, Nan::New("disk_hits").ToLocalChecked(), Nan::New((double)cache.disk_hits));
+    Nan::Set(obj, Nan::New("entries").ToLocalChecked(), Nan::New((double)cache.lru.size()));
+    Nan::Set(obj, Nan::New("size").ToLocalChecked(), Nan::New((double)cache.size));
+    Nan::Set(obj, Nan::New("max_size").ToLocalChecked(), Nan::New((double)cache.max_size));
+    Nan::Set(obj, Nan::New("disk_max_size").ToLocalChecked(), Nan::New((double)cache.disk_max_size));
+    Nan::Set(obj, Nan::New("disk_max_age").ToLocalChecked(), Nan::New(cache.disk_max_age));
+    uv_mutex_unlock(&cache.lock);
+    info.GetReturnValue().Set(obj);
+}
+
+static NAN_METHOD(setPoolOptions)
+{
+    NAN_REQUIRE_ARGUMENT_OBJECT(0, opts);
+
+    const Local<Array> names = Nan::GetPropertyNames(opts).ToLocalChecked();
+    uv_mutex_lock(&pool->lock);
+    for (uint i = 0 ; i < names->Length(); ++i) {
+        Nan::Utf8String key(Nan::Get(names, i).ToLocalChecked());
+        Nan::Utf8String val(Nan::Get(opts, Nan::Get(names, i).ToLocalChecked()).ToLocalChecked());
+        if (!strcmp(*key, "workers")) pool->workers = max(1, atoi(*val)); else
+        if (!strcmp(*key, "queue")) pool->max_queue = atoi(*val); else
+        if (!strcmp(*key, "threads")) pool->threads = atoi(*val);
+    }
+    // Idle threads above the new limit will exit
+    uv_cond_broadcast(&pool->cond);
+    bkSetPoolThreads();
+    uv_mutex_unlock(&pool->lock);
+}
+
+static NAN_METHOD(setResourceLimits)
+{
+    NAN_REQUIRE_ARGUMENT_OBJECT(0, opts);
+
+    const Local<Array> names = Nan::GetPropertyNames(opts).ToLocalChecked();
+    uv_mutex_lock(&pool->lock);
+    for (uint i = 0 ; i < names->Length(); ++i) {
+        Nan::Utf8String key(Nan::Get(names, i).ToLocalChecked());
+        Nan::Utf8String val(Nan::Get(opts, Nan::Get(names, i).ToLocalChecked()).ToLocalChecked());
+        if (!strcmp(*key, "memory")) MagickSetResourceLimit(MemoryResource, atoll(*val)); else
+        if (!strcmp(*key, "map")) MagickSetResourceLimit(MapResource, atoll(*val)); else
+        if (!strcmp(*key, "disk")) MagickSetResourceLimit(DiskResource, atoll(*val)); else
+        if (!strcmp(*key, "area")) MagickSetResourceLimit(AreaResource, atoll(*val)); else
+        if (!strcmp(*key, "width")) MagickSetResourceLimit(WidthResource, atoll(*val)); else
+        if (!strcmp(*key, "height")) MagickSetResourceLimit(HeightResource, atoll(*val)); else
+        if (!strcmp(*key, "time")) MagickSetResourceLimit(TimeResource, atoll(*val)); else
+        if (!strcmp(*key, "budget")) pool->budget = max(0LL, atoll(*val));
+    }
+    // Held jobs may fit into the new budget or must be rejected
+    bkResumeWork();
+    uv_mutex_unlock(&pool->lock);
+}
+
+static NAN_METHOD(getResourceLimits)
+{
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New("memory").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(MemoryResource)));
+    Nan::Set(obj, Nan::New("map").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(MapResource)));
+    Nan::Set(obj, Nan::New("disk").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(DiskResource)));
+    Nan::Set(obj, Nan::New("area").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(AreaResource)));
+    Nan::Set(obj, Nan::New("width").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(WidthResource)));
+    Nan::Set(obj, Nan::New("height").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(HeightResource)));
+    Nan::Set(obj, Nan::New("time").ToLocalChecked(), Nan::New((double)MagickGetResourceLimit(TimeResource)));
+    uv_mutex_lock(&pool->lock);
+    Nan::Set(obj, Nan::New("budget").ToLocalChecked(), Nan::New((double)pool->budget));
+    uv_mutex_unlock(&pool->lock);
+    info.GetReturnValue().Set(obj);
+}
+
+static NAN_METHOD(getPoolStats)
+{
+    Local<Object> obj = Nan::New<Object>();
+    uv_mutex_lock(&pool->lock);
+    Nan::Set(obj, Nan::New("workers").ToLocalChecked(), Nan::New(pool->workers));
+    Nan::Set(obj, Nan::New("running").ToLocalChecked(), Nan::New(pool->running));
+    Nan::Set(obj, Nan::New("active").ToLocalChecked(), Nan::New(pool->active));
+    Nan::Set(obj, Nan::New("queue").ToLocalChecked(), Nan::New((int)pool->queue.size()));
+    Nan::Set(obj, Nan::New("max_queue").ToLocalChecked(), Nan::New(pool->max_queue));
+    Nan::Set(obj, Nan::New("threads").ToLocalChecked(), Nan::New((int)MagickGetResourceLimit(ThreadResource)));
+    Nan::Set(obj, Nan::New("held").ToLocalChecked(), Nan::New((int)pool->held.size()));
+    Nan::Set(obj, Nan::New("budget").ToLocalChecked(), Nan::New((double)pool->budget));
+    Nan::Set(obj, Nan::New("used").ToLocalChecked(), Nan::New((double)pool->used));
+    uv_mutex_unlock(&pool->lock);
+    Nan::Set(obj, Nan::New("pending").ToLocalChecked(), Nan::New(env->pending));
+    info.GetReturnValue().Set(obj);
+}
+
+// Worker pool of this module to be shared with another one by usePool
+static NAN_METHOD(getPool)
+{
+    info.GetReturnValue().Set(Nan::New<v8::External>((void*)pool));
+}
+
+// Run jobs on the pool of another module, the 8-bit module uses the pool of the 16-bit one so both share the workers,
+// the queue and the memory budget, only before this module started any worker
+static NAN_METHOD(usePool)
+{
+    if (info.Length() < 1 || !info[0]->IsExternal()) {
+        Nan::ThrowError("Argument 0 must be a pool");
+        return;
+    }
+    WandPool *other = (WandPool *)info[0].As<v8::External>()->Value();
+    if (other == pool) return;
+    if (memcmp(other->layout, pool->layout, sizeof(pool->layout))) {
+        Nan::ThrowError("pool belongs to an incompatible module");
+        return;
+    }
+    uv_mutex_lock(&pool->lock);
+    bool busy = pool->running || pool->queue.size() || pool->held.size();
+    uv_mutex_unlock(&pool->lock);
+    if (busy) {
+        Nan::ThrowError("pool is already in use");
+        return;
+    }
+    pool = other;
+    uv_mutex_lock(&pool->lock);
+    bkSetPoolThreads();
+    uv_mutex_unlock(&pool->lock);
+}
+
+// Pipe for streaming sources and outputs as [read, write] descriptors, both are close-on-exec
+static NAN_METHOD(openPipe)
+{
+    int fds[2];
+    if (pipe(fds)) {
+        Nan::ThrowError(strerror(errno));
+        return;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    Local<Array> list = Nan::New<Array>(2);
+    Nan::Set(list, 0, Nan::New(fds[0]));
+    Nan::Set(list, 1, Nan::New(fds[1]));
+    info.GetReturnValue().Set(list);
+}
+
+// Build of ImageMagick this module is linked with, quantum is 8 or 16 bits per channel
+static NAN_METHOD(getVersion)
+{
+    size_t depth = 0;
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New("version").ToLocalChecked(), Nan::New(MagickGetVersion(NULL)).ToLocalChecked());
+    MagickGetQuantumDepth(&depth);
+    Nan::Set(obj, Nan::New("quantum").ToLocalChecked(), Nan::New((int)depth));
+#ifdef MAGICKCORE_HDRI_SUPPORT
+    Nan::Set(obj, Nan::New("hdri").ToLocalChecked(), Nan::True());
+#else
+    Nan::Set(obj, Nan::New("hdri").ToLocalChecked(), Nan::False());
+#endif
+#ifdef USE_JPEG
+    Nan::Set(obj, Nan::New("jpeg").ToLocalChecked(), Nan::True());
+#else
+    Nan::Set(obj, Nan::New("jpeg").ToLocalChecked(), Nan::False());
+#endif
+    info.GetReturnValue().Set(obj);
+}
+
+static Local<Object> getHistogram(const MagickHistogram &h)
+{
+    Local<Object> obj = Nan::New<Object>();
+    Nan::Set(obj, Nan::New("count").ToLocalChecked(), Nan::New((double)h.count));
+    Nan::Set(obj, Nan::New("sum").ToLocalChecked(), Nan::New(h.sum / 1e6));
+    Nan::Set(obj, Nan::New("max").ToLocalChecked(), Nan::New(h.max / 1e6));
+    Local<Array> buckets = Nan::New<Array>(MAGICK_HIST_SIZE);
+    for (int i = 0; i < MAGICK_HIST_SIZE; i++) Nan::Set(buckets, i, Nan::New((double)h.buckets[i]));
+    Nan::Set(obj, Nan::New("buckets").ToLocalChecked(), buckets);
+    return obj;
+}
+
+static NAN_METHOD(getStats)
+{
+    Local<Object> obj = Nan::New<Object>();
+    uv_mutex_lock(&stats.lock);
+    Nan::Set(obj, Nan::New("jobs").ToLocalChecked(), Nan::New((double)stats.jobs));
+    Nan::Set(obj, Nan::New("errors").ToLocalChecked(), Nan::New((double)stats.errors));
+    Nan::Set(obj, Nan::New("bytes_in").ToLocalChecked(), Nan::New((double)stats.bytes_in));
+    Nan::Set(obj, Nan::New("bytes_out").ToLocalChecked(), Nan::New((double)stats.bytes_out));
+    Nan::Set(obj, Nan::New("memory").ToLocalChecked(), Nan::New((double)(MagickGetResource(MemoryResource) + MagickGetResource(MapResource))));
+    Nan::Set(obj, Nan::New("peak_memory").ToLocalChecked(), Nan::New((double)stats.peak_memory));
+
+    // Upper bounds of the histogram buckets in milliseconds
+    Local<Array> bounds = Nan::New<Array>(MAGICK_HIST_SIZE);
+    for (int i = 0; i < MAGICK_HIST_SIZE; i++) {
+        Nan::Set(bounds, i, Nan::New(i < MAGICK_HIST_SIZE - 1 ? (1ULL << i) / 1e3 : INFINITY));
+    }
+    Nan::Set(obj, Nan::New("buckets").ToLocalChecked(), bounds);
+
+    Local<Object> stages = Nan::New<Object>();
+    for (int i = 0; i < MagickStageMax; i++) {
+        Nan::Set(stages, Nan::New(magickStages[i]).ToLocalChecked(), getHistogram(stats.stages[i]));
+    }
+    Nan::Set(obj, Nan::New("stages").ToLocalChecked(), stages);
+
+    Local<Object> formats = Nan::New<Object>();
+    for (unordered_map<string, MagickFormatStats>::iterator it = stats.formats.begin(); it != stats.formats.end(); ++it) {
+        Local<Object> f = Nan::New<Object>();
+        Nan::Set(f, Nan::New("jobs").ToLocalChecked(), Nan::New((double)it->second.jobs));
+        Nan::Set(f, Nan::New("errors").ToLocalChecked(), Nan::New((double)it->second.errors));
+        Nan::Set(f, Nan::New("bytes_in").ToLocalChecked(), Nan::New((double)it->second.bytes_in));
+        Nan::Set(f, Nan::New("bytes_out").ToLocalChecked(), Nan::New((double)it->second.bytes_out));
+        Nan::Set(f, Nan::New("total").ToLocalChecked(), getHistogram(it->second.total));
+        Nan::Set(formats, Nan::New(it->first).ToLocalChecked(), f);
+    }
+    Nan::Set(obj, Nan::New("formats").ToLocalChecked(), formats);
+
+    Local<Object> severity = Nan::New<Object>();
+    for (unordered_map<string, uint64_t>::iterator it = stats.severity.begin(); it != stats.severity.end(); ++it) {
+        Nan::Set(severity, Nan::New(it->first).ToLocalChecked(), Nan::New((double)it->second));
+    }
+    Nan::Set(obj, Nan::New("severity").ToLocalChecked(), severity);
+    uv_mutex_unlock(&stats.lock);
+    info.GetReturnValue().Set(obj);
+}
+
+static uv_once_t wandOnce = UV_ONCE_INIT;
+
+// Process wide state shared by all environments
+static void bkInitOnce()
+{
+    bkInitPool();
+    uv_mutex_init(&stats.lock);
+    // The mask can only be read by setting it, done once before any worker exists
+    bkUmask = umask(0);
+    umask(bkUmask);
+}
+
+// Environment teardown, running jobs are cancelled and the done callback is called once the async handle is closed
+static void bkCleanupEnv(void *arg, void (*cb)(void*), void *cbarg)
+{
+    WandEnv *e = (WandEnv *)arg;
+    e->close_cb = cb;
+    e->close_arg = cbarg;
+    bkStopEnv(e);
+}
+
+// Called once in every environment that loads the module, including worker threads
+static NAN_MODULE_INIT(WandInit)
+{
+    if (!env) {
+        v8::Isolate *isolate = v8::Isolate::GetCurrent();
+        uv_once(&wandOnce, bkInitOnce);
+        bkInitEnv(node::GetCurrentEventLoop(isolate));
+        env->cleanup = node::AddEnvironmentCleanupHook(isolate, bkCleanupEnv, env);
+    }
+
+    // Templates belong to the isolate
+    Local<FunctionTemplate> tmpl = Nan::New<FunctionTemplate>(MagickPreset::New);
+    tmpl->SetClassName(Nan::New("MagickPreset").ToLocalChecked());
+    tmpl->InstanceTemplate()->SetInternalFieldCount(1);
+    env->preset.Reset(tmpl);
+
+    NAN_EXPORT(target, resizeImage);
+    NAN_EXPORT(target, resizeImages);
+    NAN_EXPORT(target, convertBatch);
+    NAN_EXPORT(target, probeImage);
+    NAN_EXPORT(target, cancelImage);
+    NAN_EXPORT(target, compilePreset);
+    NAN_EXPORT(target, setPoolOptions);
+    NAN_EXPORT(target, setCacheOptions);
+    NAN_EXPORT(target, getCacheStats);
+    NAN_EXPORT(target, getPoolStats);
+    NAN_EXPORT(target, getPool);
+    NAN_EXPORT(target, usePool);
+    NAN_EXPORT(target, getStats);
+    NAN_EXPORT(target, setResourceLimits);
+    NAN_EXPORT(target, getResourceLimits);
+    NAN_EXPORT(target, getVersion);
+    NAN_EXPORT(target, openPipe);
+}
+#endif
+#else
+static NAN_MODULE_INIT(WandInit)
+{
+}
+#endif
+
+#ifndef WAND_NO_NODE
+NAN_MODULE_WORKER_ENABLED(binding, WandInit)
+#endif
@@ -1,4 +1,7 @@
 {
+    "variables": {
+      "with_q8": "<!(test -f build/q8/lib/pkgconfig/MagickWand.pc && echo 1 || echo 0)"
+    },
     "target_defaults": {
       "include_dirs": [
         "build/include",
@@ -12,10 +15,12 @@
       "target_name": "binding",
       "defines": [
         "<!@(export PKG_CONFIG_PATH=`pwd`/build/lib/pkgconfig; if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists MagickWand; then echo USE_WAND; fi)",
+        "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libjpeg; then echo USE_JPEG; fi)",
       ],
       "libraries": [
         "-L/opt/local/lib",
-        "$(shell PKG_CONFIG_PATH=$$(pwd)/lib/pkgconfig pkg-config --silence-errors --static --libs MagickWand)"
+        "$(shell PKG_CONFIG_PATH=$$(pwd)/lib/pkgconfig pkg-config --silence-errors --static --libs MagickWand)",
+        "$(shell pkg-config --silence-errors --libs libjpeg)"
       ],
       "sources": [
         "binding.cpp",
@@ -42,5 +47,131 @@
           ],
         }],
       ]
-    }]
+    },
+    {
+      "target_name": "bench",
+      "type": "executable",
+      "suppress_wildcard": 1,
+      "defines": [
+        "<!@(export PKG_CONFIG_PATH=`pwd`/build/lib/pkgconfig; if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists MagickWand; then echo USE_WAND; fi)",
+        "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libjpeg; then echo USE_JPEG; fi)",
+        "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libuv; then :; else echo WAND_NO_UV; fi)",
+      ],
+      "libraries": [
+        "-L/opt/local/lib",
+        "$(shell PKG_CONFIG_PATH=$$(pwd)/lib/pkgconfig pkg-config --silence-errors --static --libs MagickWand)",
+        "$(shell pkg-config --silence-errors --libs libjpeg)",
+        "$(shell pkg-config --silence-errors --libs libuv || echo -lpthread)"
+      ],
+      "sources": [
+        "bench/resize.cpp",
+      ],
+      "conditions": [
+        [ 'OS=="mac"', {
+          "defines": [
+            "OS_MACOSX",
+          ],
+          "xcode_settings": {
+            "OTHER_CFLAGS": [
+              "-g",
+              "$(shell PKG_CONFIG_PATH=$$(pwd)/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)"
+            ],
+          },
+        }],
+        [ 'OS=="linux"', {
+          "defines": [
+            "OS_LINUX",
+          ],
+          "cflags_cc+": [
+            "-g",
+            "$(shell PKG_CONFIG_PATH=$$(pwd)/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)",
+          ],
+        }],
+      ]
+    }],
+    "conditions": [
+      [ 'with_q8==1', {
+        "targets": [
+        {
+          "target_name": "binding_q8",
+          "defines": [
+            "USE_WAND",
+            "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libjpeg; then echo USE_JPEG; fi)",
+          ],
+          "libraries": [
+            "-L/opt/local/lib",
+            "-L$(shell pwd)/lib",
+            "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --static --libs MagickWand)",
+            "$(shell pkg-config --silence-errors --libs libjpeg)"
+          ],
+          "sources": [
+            "binding.cpp",
+          ],
+          "conditions": [
+            [ 'OS=="mac"', {
+              "defines": [
+                "OS_MACOSX",
+              ],
+              "xcode_settings": {
+                "OTHER_CFLAGS": [
+                  "-g -fPIC",
+                  "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)"
+                ],
+              },
+            }],
+            [ 'OS=="linux"', {
+              "defines": [
+                "OS_LINUX",
+              ],
+              "cflags_cc+": [
+                "-g -fPIC -rdynamic",
+                "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)",
+              ],
+            }],
+          ]
+        },
+        {
+          "target_name": "bench_q8",
+          "type": "executable",
+          "suppress_wildcard": 1,
+          "defines": [
+            "USE_WAND",
+            "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libjpeg; then echo USE_JPEG; fi)",
+            "<!@(if which pkg-config 2>/dev/null 1>&2 && pkg-config --exists libuv; then :; else echo WAND_NO_UV; fi)",
+          ],
+          "libraries": [
+            "-L/opt/local/lib",
+            "-L$(shell pwd)/lib",
+            "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --static --libs MagickWand)",
+            "$(shell pkg-config --silence-errors --libs libjpeg)",
+            "$(shell pkg-config --silence-errors --libs libuv || echo -lpthread)"
+          ],
+          "sources": [
+            "bench/resize.cpp",
+          ],
+          "conditions": [
+            [ 'OS=="mac"', {
+              "defines": [
+                "OS_MACOSX",
+              ],
+              "xcode_settings": {
+                "OTHER_CFLAGS": [
+                  "-g",
+                  "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)"
+                ],
+              },
+            }],
+            [ 'OS=="linux"', {
+              "defines": [
+                "OS_LINUX",
+              ],
+              "cflags_cc+": [
+                "-g",
+                "$(shell PKG_CONFIG_PATH=$$(pwd)/q8/lib/pkgconfig pkg-config --silence-errors --cflags MagickWand)",
+              ],
+            }],
+          ]
+        }]
+      }]
+    ]
 }
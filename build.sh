@@ -16,12 +16,16 @@ fi
 (cd $BKJS_DEPS/openjpeg && make install)
 
 pkg-config --silence-errors --exists Wand
-if [ ! -d $BKJS_DEPS/ImageMagick ]; then
-   mkdir -p $BKJS_DEPS/ImageMagick
-   curl -OL https://imagemagick.org/archive/ImageMagick.tar.gz
-   tar -C $BKJS_DEPS/ImageMagick --strip-components=1 -xzf ImageMagick.tar.gz && rm -rf ImageMagick.tar.gz
-fi
-(cd $BKJS_DEPS/ImageMagick && [ ! -f Makefile ] && ./configure --prefix=$BKJS_PREFIX \
+
+# Static ImageMagick from the same source archive, the first argument is the source directory, the rest are configure options
+magick() {
+   dir=$BKJS_DEPS/$1
+   shift
+   if [ ! -d $dir ]; then
+      [ ! -f $BKJS_DEPS/ImageMagick.tar.gz ] && curl -L -o $BKJS_DEPS/ImageMagick.tar.gz https://imagemagick.org/archive/ImageMagick.tar.gz
+      mkdir -p $dir && tar -C $dir --strip-components=1 -xzf $BKJS_DEPS/ImageMagick.tar.gz
+   fi
+   (cd $dir && [ ! -f Makefile ] && ./configure "$@" \
                  --disable-docs \
                  --disable-installed \
                  --disable-shared \
@@ -30,8 +34,17 @@ fi
                  --without-x \
                  --without-magick-plus-plus \
                  --without-perl)
-(cd $BKJS_DEPS/ImageMagick && make install)
+   (cd $dir && make install)
+}
+
+# Default Q16 HDRI build for the binding module
+magick ImageMagick --prefix=$BKJS_PREFIX
+
+# 8-bit build without HDRI into build/q8 for the binding_q8 module, BKJS_WAND_Q8=0 skips it
+[ "$BKJS_WAND_Q8" != "0" ] && magick ImageMagick-q8 --prefix=$BKJS_PREFIX/q8 --with-quantum-depth=8 --disable-hdri
+rm -f $BKJS_DEPS/ImageMagick.tar.gz
+
 ISED="-i"
 [ "$(uname -s)" = "Darwin" ] && ISED="-i .orig"
-for f in $BKJS_PREFIX/lib/pkgconfig/*; do sed $ISED 's/MAGICK_EXTRA_DEP_LIBS//' $f;done
+for f in $BKJS_PREFIX/lib/pkgconfig/* $BKJS_PREFIX/q8/lib/pkgconfig/*; do [ -f $f ] && sed $ISED 's/MAGICK_EXTRA_DEP_LIBS//' $f;done
 exit 0
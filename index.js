@@ -0,0 +1,285 @@
+//
+// Native binding with the promise API on top
+//
+
+var fs = require("fs");
+var os = require("os");
+var path = require("path");
+var crypto = require("crypto");
+var binding = require("./build/Release/binding");
+
+module.exports = binding;
+
+// Native modules by precision, the 8-bit one is optional, see build.sh
+var engines = { 16: Object.assign({}, binding) };
+try { engines[8] = require("./build/Release/binding_q8"); } catch (e) {}
+if (engines[8] && !engines[8].resizeImage) delete engines[8];
+// One pool for both so the workers and the memory budget are not doubled
+if (engines[8]) engines[8].usePool(binding.getPool());
+
+var precision = process.env.BKJS_WAND_PRECISION == 8 ? 8 : 16;
+
+// Returns the native module for 8 or 16 bits per channel, 16 if the 8-bit one is not built
+binding.getEngine = function(bits)
+{
+    return engines[bits || precision] || engines[16];
+}
+
+// Precision of jobs without the precision option and of the stats functions, returns false if not available
+binding.setPrecision = function(bits)
+{
+    if (!engines[bits]) return false;
+    precision = bits;
+    return true;
+}
+
+binding.getPrecision = function()
+{
+    return engines[precision] ? precision : 16;
+}
+
+// Compiled presets belong to the engine they were compiled with
+function engine(options)
+{
+    return binding.getEngine(options && (options.precision || options.preset && options.preset.precision));
+}
+
+// Job ids of the 8-bit engine are negative
+function jobId(e, id)
+{
+    return e === engines[16] || !id ? id : -id;
+}
+
+// Jobs with stream sources by id while the stream is written into a temporary file, the ids are above the 32-bit
+// native ids, the native id is kept once the job is started
+var spools = {}, spoolId = 0, SPOOL_ID = 0x100000000;
+
+function isStream(source)
+{
+    if (source && source.stream) source = source.stream;
+    return !!source && typeof source.pipe == "function" && typeof source.read == "function";
+}
+
+// Readable streams are written into a temporary file by the event loop first so no pool worker waits for the data,
+// the job is started with the file once the stream ends and reads it like any other file, with the memory estimate
+// and the reduced JPEG decode, the format can be given as { stream, ext }. The run function starts the native job
+// with the file and the rest of the timeout, stream and file errors fail the job, returns the job id
+function spoolSource(source, timeout, callback, run)
+{
+    var ext = source.stream && String(source.ext || "").replace(/[^a-zA-Z0-9]/g, "");
+    var stream = source.stream || source, started = Date.now(), timer;
+    var file = path.join(os.tmpdir(), "bkjs-wand-" + process.pid + "-" + crypto.randomBytes(8).toString("hex") + (ext ? "." + ext : ""));
+    var out = fs.createWriteStream(file, { flags: "wx", mode: 0o600 });
+    var id = SPOOL_ID + (++spoolId), job = spools[id] = {};
+
+    function unlink() {
+        fs.unlink(file, function() {});
+    }
+
+    function done(err) {
+        if (job.done) return;
+        job.done = 1;
+        clearTimeout(timer);
+        stream.removeListener("error", done);
+        stream.unpipe(out);
+        // The file may be created after this if it is still being opened
+        out.destroy();
+        out.once("close", unlink);
+        unlink();
+        delete spools[id];
+        if (typeof callback == "function") callback.apply(null, arguments);
+    }
+    job.cancel = function() {
+        done(new Error("image job cancelled"));
+    }
+
+    if (timeout > 0) timer = setTimeout(function() { done(new Error("image job timed out")) }, timeout);
+    stream.on("error", done);
+    out.on("error", done);
+    out.on("close", function() {
+        if (job.done) return;
+        stream.removeListener("error", done);
+        clearTimeout(timer);
+        try {
+            job.id = run(file, timeout > 0 ? Math.max(1, timeout - (Date.now() - started)) : timeout, function() {
+                unlink();
+                delete spools[id];
+                if (typeof callback == "function") callback.apply(null, arguments);
+            });
+        } catch (e) {
+            done(e);
+        }
+    });
+    stream.pipe(out);
+    return id;
+}
+
+// Writable streams in outfile receive the encoded image from the event loop once the job is done, the worker only
+// encodes into a Buffer so a slow consumer never holds it, the callback is called once all streams are written,
+// they are ended on success only so a failed image is not mistaken for a complete one, the data is null for them
+function streamOutputs(list, callback)
+{
+    var streams = [];
+
+    list = list.map(function(options, i) {
+        var stream = options && options.outfile;
+        if (!stream || typeof stream.write != "function") return options;
+        var opts = {};
+        for (var p in options) if (p != "outfile") opts[p] = options[p];
+        streams.push([stream, i]);
+        return opts;
+    });
+    if (!streams.length) return { list: list, callback: callback };
+
+    return { list: list, callback: function(err, data, info) {
+        var args = arguments, pending = 1;
+        function done() {
+            if (--pending) return;
+            if (typeof callback == "function") callback.apply(null, args);
+        }
+        streams.forEach(function(item) {
+            var i = item[1], buf = Array.isArray(data) ? data[i] : data;
+            // Renditions fail separately with the error in their info
+            var rinfo = Array.isArray(info) ? info[i] : info;
+            if (Array.isArray(data)) data[i] = null; else args[1] = null;
+            if (err || !buf || (rinfo && rinfo.error)) return;
+            var stream = item[0], called;
+            function finish() {
+                if (called) return;
+                called = 1;
+                stream.removeListener("error", finish);
+                done();
+            }
+            pending++;
+            stream.once("error", finish);
+            stream.end(buf, finish);
+        });
+        done();
+    } };
+}
+
+binding.resizeImage = function(source, options, callback)
+{
+    if (isStream(source)) {
+        return spoolSource(source, options && options.timeout, callback, function(file, timeout, cb) {
+            return binding.resizeImage(file, timeout ? Object.assign({}, options, { timeout: timeout }) : options, cb);
+        });
+    }
+    var e = engine(options), out = streamOutputs([options], callback);
+    return jobId(e, e.resizeImage(source, out.list[0], out.callback));
+}
+
+// All renditions are made by the engine of the first one
+binding.resizeImages = function(source, list, callback)
+{
+    if (isStream(source)) {
+        return spoolSource(source, 0, callback, function(file, timeout, cb) {
+            return binding.resizeImages(file, list, cb);
+        });
+    }
+    var e = engine(Array.isArray(list) && list[0]);
+    var out = Array.isArray(list) ? streamOutputs(list, callback) : { list: list, callback: callback };
+    return jobId(e, e.resizeImages(source, out.list, out.callback));
+}
+
+binding.convertBatch = function(options, callback)
+{
+    return engine(options).convertBatch(options, callback);
+}
+
+binding.probeImage = function(source, callback)
+{
+    if (isStream(source)) {
+        return spoolSource(source, 0, callback, function(file, timeout, cb) {
+            return binding.probeImage(file, cb);
+        });
+    }
+    return engine().probeImage(source, callback);
+}
+
+// Jobs still spooling their stream source are cancelled right away
+binding.cancelImage = function(id)
+{
+    if (Math.abs(id) >= SPOOL_ID) {
+        var job = spools[id];
+        if (!job) return false;
+        if (job.id) return binding.cancelImage(job.id);
+        job.cancel();
+        return true;
+    }
+    return id < 0 ? binding.getEngine(8).cancelImage(-id) : engines[16].cancelImage(id);
+}
+
+binding.compilePreset = function(options)
+{
+    var e = engine(options), preset = e.compilePreset(options);
+    Object.defineProperty(preset, "precision", { value: e === engines[16] ? 16 : 8 });
+    return preset;
+}
+
+// The pool and the budget are shared, each engine updates its own ImageMagick thread and resource limits
+var setters = ["setPoolOptions", "setResourceLimits"];
+setters.forEach(function(name) {
+    binding[name] = function(options) {
+        for (var p in engines) engines[p][name](options);
+    }
+});
+
+// Each engine has its own memory cache, the size is split between them, the disk cache directory is trimmed as a whole
+binding.setCacheOptions = function(options)
+{
+    var n = Object.keys(engines).length;
+    if (n > 1 && options && options.size > 0) options = Object.assign({}, options, { size: Math.floor(options.size / n) });
+    for (var p in engines) engines[p].setCacheOptions(options);
+}
+
+// Stats are of the engine selected by setPrecision
+var getters = ["getPoolStats", "getCacheStats", "getStats", "getResourceLimits", "getVersion"];
+getters.forEach(function(name) {
+    binding[name] = function() {
+        return engine()[name]();
+    }
+});
+
+// Promise version of resizeImage, resolves with { data, info }, the options may have:
+// - signal - an AbortSignal, aborting rejects right away, the job is removed from the queue or stopped if running
+// - timeout - milliseconds since the call for the whole job including waiting in the queue
+binding.resize = function(source, options)
+{
+    return new Promise(function(resolve, reject) {
+        var signal = options && options.signal, id, done;
+
+        if (signal && signal.aborted) return reject(abortError(signal));
+
+        // Presets are passed as is, signal is not a native option
+        var opts = options;
+        if (signal) {
+            opts = {};
+            for (var p in options) if (p != "signal") opts[p] = options[p];
+        }
+
+        function onabort() {
+            if (done) return;
+            done = 1;
+            if (id) binding.cancelImage(id);
+            reject(abortError(signal));
+        }
+
+        id = binding.resizeImage(source, opts, function(err, data, info) {
+            if (done) return;
+            done = 1;
+            if (signal) signal.removeEventListener("abort", onabort);
+            if (err) reject(err); else resolve({ data: data, info: info });
+        });
+        if (signal && !done) signal.addEventListener("abort", onabort);
+    });
+}
+
+function abortError(signal)
+{
+    if (signal.reason instanceof Error) return signal.reason;
+    var err = new Error("The operation was aborted");
+    err.name = "AbortError";
+    err.code = "ABORT_ERR";
+    return err;
+}
@@ -0,0 +1,48 @@
+//
+// Cascaded renditions must not inherit encoder options of the larger rendition they are made from
+//
+// node test/cascade.js
+//
+
+var assert = require("assert");
+var wand = require("../index");
+
+var width = 640, height = 480;
+var data = Buffer.alloc(width * height * 3);
+for (var i = 0; i < data.length; i++) data[i] = (i * 7 + (i / 1920 | 0) * 13) & 255;
+var source = { data: data, width: width, height: height, layout: "RGB" };
+
+// Start of frame marker of a JPEG: C0 baseline, C2 progressive
+function jpegFrame(buf)
+{
+    for (var i = 2; i + 3 < buf.length; ) {
+        if (buf[i] != 0xFF) return 0;
+        var m = buf[i + 1];
+        if (m >= 0xC0 && m <= 0xC2) return m;
+        i += 2 + buf.readUInt16BE(i + 2);
+    }
+    return 0;
+}
+
+// First chunk of a WebP: "VP8L" lossless, "VP8 " lossy, "VP8X" extended
+function webpChunk(buf)
+{
+    return buf.toString("latin1", 12, 16);
+}
+
+var list = [
+    { width: 320, height: 240, ext: "jpg", quality: 90, progressive: 1, sampling: "1x1" },
+    { width: 160, height: 120, ext: "jpg", quality: 60, progressive: 0 },
+    { width: 120, height: 90, ext: "webp", lossless: 1 },
+    { width: 80, height: 60, ext: "webp", quality: 70 },
+];
+
+wand.resizeImages(source, list, function(err, data, info) {
+    assert.ifError(err);
+    info.forEach(function(item) { assert.ifError(item.error) });
+    assert.equal(jpegFrame(data[0]), 0xC2, "first JPEG is progressive");
+    assert.equal(jpegFrame(data[1]), 0xC0, "second JPEG is baseline");
+    assert.equal(webpChunk(data[2]), "VP8L", "first WebP is lossless");
+    assert.equal(webpChunk(data[3]), "VP8 ", "second WebP is lossy");
+    console.log("cascade: ok");
+});